@@ -0,0 +1,103 @@
+/**
+ *****************************************************************************
+
+ @file       dfconv.c
+
+ @brief      Converter into the raw image format
+
+ @author 
+
+ @date       2026-10-16
+
+ @version    $Id:$
+
+  ----------------------------------------------------------------------------
+  RELEASE NOTE :
+
+   DATE          REV    REMARK
+  ============= ====== =======================================================
+  16th Oct 2026  0.1    First release
+
+ *****************************************************************************/
+
+#include "dfframe.h"
+
+
+// names of the pixel formats
+static const struct {
+    const char *            name;
+    DFBSurfacePixelFormat   format;
+} formats[] = {
+    {"ARGB",     DSPF_ARGB},
+    {"RGB32",    DSPF_RGB32},
+    {"RGB24",    DSPF_RGB24},
+    {"RGB16",    DSPF_RGB16},
+    {"ARGB1555", DSPF_ARGB1555},
+    {"ARGB4444", DSPF_ARGB4444},
+};
+
+
+/**
+ * Print the usage
+ * @param name program name
+ */
+static void usage (const char *name)
+{
+
+    int                     i;
+
+    fprintf(stderr, "usage: %s [-f format] input output\n", name);
+    fprintf(stderr, "format:");
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        fprintf(stderr, " %s", formats[i].name);
+    }
+    fprintf(stderr, "\n");
+
+}
+
+
+/**
+ * Main function
+ */
+int main (int argc, char **argv)
+{
+
+    DFBSurfacePixelFormat   format = DSPF_UNKNOWN;
+    int                     arg = 1;
+    int                     i;
+    bool                    ok;
+
+    // no display is needed
+    initOffscreen(&argc, &argv, 0, 0, DSPF_UNKNOWN);
+
+    // pixel format, selected by the image by default
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+            if (strcasecmp(argv[2], formats[i].name) == 0) {
+                format = formats[i].format;
+            }
+        }
+        if (format == DSPF_UNKNOWN) {
+            usage(argv[0]);
+            release();
+            return 1;
+        }
+        arg = 3;
+    }
+
+    if (argc - arg != 2) {
+        usage(argv[0]);
+        release();
+        return 1;
+    }
+
+    ok = convertRawImage(argv[arg], argv[arg + 1], format);
+    if (! ok) {
+        fprintf(stderr, "%s: cannot convert %s\n", argv[0], argv[arg]);
+    }
+
+    release();
+
+    return ok ? 0 : 1;
+
+}
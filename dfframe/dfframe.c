@@ -18,6 +18,8 @@
   ============= ====== =======================================================
   26th May 2015  0.1   Initial release
   30th Mar 2016  0.2   Add network interfaces
+  16th Oct 2026  0.3   Add offscreen mode
+  16th Oct 2026  0.4   Add audio engine
 
  *****************************************************************************/
 
@@ -35,10 +37,51 @@ static IDirectFBSurface *     primary     = NULL;
 // current color
 static color_t                ccolor      = {0, 0, 0, 0xff};
 
-// surface for logo
+// table of image slots, growing on demand
+// slots below NUM_SURFACE are left for the index based functions
 #define NUM_SURFACE 10
-static IDirectFBSurface *     logo[NUM_SURFACE];
-static DFBSurfaceDescription  ldsc[NUM_SURFACE];
+static imageslot_t *          images      = NULL;
+static int                    nimages     = 0;
+static int                    freehint    = NUM_SURFACE;
+
+// hash table of the image paths, heads of the chains
+static int                    imagehash[IMAGE_HASH];
+
+// lock of the image slots, the cache and the loading jobs, also taken
+// for the references of the recorded surfaces and the sprite tables
+static pthread_mutex_t        imageLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         imageCond   = PTHREAD_COND_INITIALIZER;
+
+// jobs to load images in background, priority queue
+static imagejob_t *           jobs        = NULL;
+static int                    njobs       = 0;
+static int                    maxjobs     = 0;
+static unsigned long          jobseq      = 0;
+static pthread_cond_t         jobCond     = PTHREAD_COND_INITIALIZER;
+
+// threads to load images in background
+static pthread_t              loaders[LOADER_THREADS];
+static int                    nloaders    = 0;
+static bool                   loading     = false;
+
+// cache of the decoded images, most recently used at the head
+static cachedimage_t *        cachehash[IMAGE_HASH];
+static cachedimage_t *        cachehead   = NULL;
+static cachedimage_t *        cachetail   = NULL;
+static size_t                 cachebytes  = 0;
+static size_t                 cachebudget = IMAGE_CACHE_BUDGET;
+
+// mapped raw images released, unmapped at a flip when no recorded
+// command holds a surface any more
+static rawmap_t *             retired     = NULL;
+static int                    heldSources = 0;
+
+// pages of the texture atlas and sprites packed into them
+static atlaspage_t *          pages       = NULL;
+static int                    npages      = 0;
+static spriteslot_t *         sprites     = NULL;
+static int                    nsprites    = 0;
+static int                    maxsprites  = 0;
 
 // buffer for the button input events
 static IDirectFBEventBuffer * eventbuffer = NULL;
@@ -48,9 +91,70 @@ static IDirectFBFont *        font        = NULL;
 static DFBFontDescription     fdsc;
 static pthread_mutex_t        fontLock    = PTHREAD_MUTEX_INITIALIZER;
 
+// font registry, the current font and the font set to the primary surface
+static fontslot_t             fonts[FONT_CACHE_SIZE];
+static font_t                 curfont     = FONT_NONE;
+static unsigned long          fonttick    = 0;
+static IDirectFBFont *        primaryFont = NULL;
+
+// rendered texts, hash chains and LRU list from the most recent
+static text_t *               texthash[TEXT_HASH];
+static text_t *               texthead    = NULL;
+static text_t *               texttail    = NULL;
+static int                    ntexts      = 0;
+
+// free surfaces by size class, and message boxes rendered before
+static surfpool_t             pools[POOL_CLASSES][POOL_CLASSES];
+static size_t                 poolbytes   = 0;
+static msgbox_t *             boxhash[BOX_HASH];
+static msgbox_t *             boxhead     = NULL;
+static msgbox_t *             boxtail     = NULL;
+static int                    nboxes      = 0;
+
 // properties of the primary surface
 static DFBSurfaceDescription  dsc;
 
+// flags used to flip the primary surface
+static DFBSurfaceFlipFlags    flipflags   = DSFLIP_WAITFORSYNC;
+
+// offscreen (headless) mode
+static bool                   offscreen   = false;
+static int                    offwidth    = OFFSCREEN_WIDTH;
+static int                    offheight   = OFFSCREEN_HEIGHT;
+static DFBSurfacePixelFormat  offformat   = OFFSCREEN_FORMAT;
+
+// damaged regions of the back buffer since the last flip
+static DFBRegion              damage[MAX_DAMAGE];
+static int                    ndamage     = 0;
+static bool                   partialFlip = false;
+
+// keep the back buffer same as the front buffer after flip
+static bool                   backSync    = false;
+
+// deferred drawing commands
+static cmdbuf_t               cmdbuf      = {NULL, 0, 0};
+static bool                   deferred    = false;
+
+// drawing context of the calling thread, and the batches waiting for flip
+static __thread drawctx_t *   context     = NULL;
+static ctxbatch_t *           submitted   = NULL;
+
+// scratch arrays for batched submission
+static union {
+    DFBRegion                 lines[BATCH_SIZE];
+    DFBRectangle              rects[BATCH_SIZE];
+    DFBTriangle               tris [BATCH_SIZE];
+} batch;
+static DFBPoint               batchpts[BATCH_SIZE];
+static const command_t *      batchcmds[BATCH_SIZE];
+
+// state of the primary surface known to be set
+static color_t                stcolor;
+static bool                   stcolorValid = false;
+static DFBSurfaceBlittingFlags stblit;
+static bool                   stblitValid = false;
+static statestats_t           ststats     = {0, 0};
+
 // X cordinate resolution of the primary surface
 static int                    xres        = 0;
 
@@ -60,15 +164,72 @@ static int                    yres        = 0;
 // current position
 static position_t             curpos      = {0, 0};
 
-// array for position values
+// touch position filter, used by the thread filtering the samples
+static touchfilter_t          tfilter     = {FILTER_AVERAGE, FILTER_WINDOW,
+                                             FILTER_ALPHA, FILTER_MINCUTOFF,
+                                             FILTER_BETA, FILTER_DCUTOFF};
+
+// filter set by setTouchFilter(), taken at the next sample
+static touchfilter_t          newfilter   = {FILTER_AVERAGE, FILTER_WINDOW,
+                                             FILTER_ALPHA, FILTER_MINCUTOFF,
+                                             FILTER_BETA, FILTER_DCUTOFF};
+static bool                   filterSet   = false;
+static pthread_mutex_t        filterLock  = PTHREAD_MUTEX_INITIALIZER;
+
+// ring buffer of position values and their running sums
 static position_t             positions[POSSAMPLES];
+static int                    ringhead    = 0;
+static long                   sumx        = 0;
+static long                   sumy        = 0;
 
 // number of position samples
 static int                    samples     = 0;
 
+// smoothed position and speed in pixels, time of the last sample
+static double                 fx;
+static double                 fy;
+static double                 fdx;
+static double                 fdy;
+static struct timeval         lastSample;
+static unsigned int           lastReceived = 0;
+
 // semaphore for position determinating synchronization
 static sem_t                  positiondet;
 
+// input thread and the ring of touch events it produces
+static pthread_t              inputth;
+static bool                   inputRunning = false;
+static touchring_t            inputring;
+
+// touch state and position taken from the ring by the render loop
+static TouchState             qstate      = RELEASED;
+static position_t             qpos        = {0, 0};
+
+// touch position predictor and its state on X and Y
+static PredictKind            predictKind = PREDICT_NONE;
+static double                 predictLead = PREDICT_LEAD;
+static predictaxis_t          predx;
+static predictaxis_t          predy;
+static struct timeval         predictTime;
+static int                    predictSamples = 0;
+
+// time of the oldest input taken but not shown yet, 0 if none
+static unsigned int           pendingInput = 0;
+
+// histogram of the touch-to-photon latency in microseconds
+static unsigned int           latencyhist[LATENCY_BUCKETS];
+static unsigned int           latencymax  = 0;
+
+// interval of the latency dump in seconds, 0 if disabled
+static int                    latencyDump = 0;
+static time_t                 lastDump    = 0;
+
+// frame profiler, ring of the frames recorded
+static bool                   profiling   = false;
+static profframe_t *          profframes  = NULL;
+static int                    profframe   = 0;
+static unsigned long          profcount   = 0;
+
 // touch state
 static TouchState             tstate      = RELEASED;
 static struct timespec        lastTouch;
@@ -78,10 +239,36 @@ static const long             ignoreItrvl = 100000000;
 static bool                   playNow     = false;
 static pthread_mutex_t        playLock    = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t              playth;
-static time_t                 playtime;
-static char *                 aplay       = "aplay  -D hw:0,1 ";
-static char *                 mpg123      = "mpg123 -a hw:0,1 ";
-static char                   musicCommand[STRBUFFLEN];
+static bool                   playJoin    = false;
+static char                   musicPath[STRBUFFLEN];
+static voice_t                music       = {NULL, NULL, 0, AUDIO_UNITY, -1, 0,
+                                                            false, false};
+static stream_t               stream;
+
+// audio engine writing the periods from the real-time thread
+static snd_pcm_t *            pcmdev      = NULL;
+static pthread_t              audioth;
+static bool                   audioRun    = false;
+static pthread_mutex_t        audioLock   = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int           audioRate   = AUDIO_RATE;
+static snd_pcm_uframes_t      periodSize  = AUDIO_PERIOD;
+static int16_t *              periodBuf   = NULL;
+static int32_t *              mixBuf      = NULL;
+
+// clock of the frames heard, and the periods in the device
+static audioclock_t           aclock;
+static periodmark_t           marks[AUDIO_HISTORY];
+static int                    nextMark    = 0;
+static uint64_t               written     = 0;
+static __thread double        lastClock   = 0;
+
+// sound effects decoded in the cache, and the triggers to the audio thread
+static soundslot_t            sounds[SOUND_CACHE_SIZE];
+static unsigned long          soundtick   = 0;
+static soundring_t            soundring;
+static pthread_mutex_t        soundLock   = PTHREAD_MUTEX_INITIALIZER;
+static voice_t                effects[AUDIO_VOICES - 1];
+static unsigned long          effecttick  = 0;
 
 /* ------------------------------------------------------------------------- */
 
@@ -90,10 +277,65 @@ static char                   musicCommand[STRBUFFLEN];
 /* ---------------------------- implementations ---------------------------- */
 
 static void   _initialize       (void);
-static void   _clearLogoSurface (void);
+static bool   _hasOption        (int argc, char **argv, const char *name);
+static void   _clearImages      (void);
+static bool   _growImages       (int num);
+static void   _linkPath         (int index, const char *path);
+static void   _unlinkPath       (int index);
+static cachedimage_t * _findCache (const char *path);
+static cachedimage_t * _addCache  (const char *path, time_t mtime,
+                                   IDirectFBSurface *surface,
+                                   const DFBSurfaceDescription *desc,
+                                   void *map, size_t mapsize);
+static void   _retireMap        (void *map, size_t mapsize);
+static void   _unmapRetired     (void);
+static void   _unrefCache       (cachedimage_t *c);
+static void   _trimCache        (void);
+static unsigned int _nextGeneration (unsigned int generation, int bits);
+static int    _lruSlot          (int num, unsigned long (*used)(int i));
+static void   _releaseImage     (int index);
+static bool   _loadImage        (int index, const char *path);
+static void * _loaderThread     (void *data);
+static void   _stopLoaders      (void);
 static bool   _checkIndex       (int index);
 static bool   _checkSurface     (int index);
+static void   _addDamage        (int x1, int y1, int x2, int y2);
+static bool   _pushInput        (TouchEventKind kind, const struct timeval *t);
+static void   _takeInput        (unsigned int received);
+static void   _predict          (position_t p, const struct timeval *t);
+static bool   _presentFrame     (void);
+static unsigned int _usec       (void);
+static unsigned int _received   (const struct timeval *t);
+static void   _recordLatency    (unsigned int us);
+static void   _dumpLatency      (void);
+static void   _flip             (void);
+static void   _destroyText      (text_t *t);
+static void   _releaseFont      (int i);
+static unsigned long _fontUsed  (int i);
+static void   _destroyBox       (msgbox_t *b);
+static void   _drainPools       (void);
+static void   _trimPools        (void);
+static void   _nextProfFrame    (void);
+static void   _damageRect       (int x, int y, int w, int h);
+static void   _damageText       (IDirectFBFont *f, const char *text,
+                                 position_t p, DFBSurfaceTextFlags flg);
+static void   _invalidateState  (void);
+static void   _applyColor       (color_t c);
+static void   _applyBlittingFlags (DFBSurfaceBlittingFlags flags);
+static command_t * _newCommand  (cmdbuf_t *b, CommandKind kind);
+static command_t * _record      (CommandKind kind);
+static void   _queued           (command_t *c, int x1, int y1, int x2, int y2);
+static void   _unrecord         (void);
+static void   _holdSource       (command_t *c, IDirectFBSurface *s);
+static void   _submitCommands   (cmdbuf_t *b);
+static void   _discardCommands  (cmdbuf_t *b);
+static void   _mergeContexts    (void);
+static void   _freeBatches      (ctxbatch_t *b);
+static void   _flushCommands    (void);
 static void * _playMusic        (void *data);
+static bool   _startAudio       (void);
+static void   _stopAudio        (void);
+static unsigned long _soundUsed (int i);
 
 /**
  * Internal initializing tasks
@@ -107,65 +349,90 @@ static void _initialize (void)
 
 
 /**
- * Clear array of pointer for logo surface
+ * Check if a DirectFB option is given in the arguments
+ * @param argc number of arguments
+ * @param argv string array of the arguments
+ * @param name option name without "--dfb:" prefix
+ * @return true if the option is found
  */
-static void _clearLogoSurface (void)
+static bool _hasOption (int argc, char **argv, const char *name)
 {
 
     int                     i;
 
-    for (i = 0; i < NUM_SURFACE; i++) {
-        logo[i] = NULL;
+    // options are given as "--dfb:name=value,name=value,..."
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--dfb:", 6) != 0) {
+            continue;
+        }
+        if (strstr(argv[i] + 6, name) != NULL) {
+            return true;
+        }
     }
 
+    return false;
+
 }
 
 
 /**
- * Check if the primary surface is available
- * and the index is valid
- * @return true on valid index and primary surface
+ * Clear the table of image slots
  */
-static bool _checkIndex (int index)
+static void _clearImages (void)
 {
 
-    // check if primary surface is available
-    if (primary == NULL) {
-        return false;
-    }
+    int                     i;
 
-    // check if index is valid
-    if (index < 0 || index >= NUM_SURFACE) {
-        return false;
+    for (i = 0; i < IMAGE_HASH; i++) {
+        imagehash[i] = -1;
     }
 
-    return true;
+    free(images);
+    images   = NULL;
+    nimages  = 0;
+    freehint = NUM_SURFACE;
 
 }
 
 
 /**
- * Check if the primary and logo surface is available
- * and the index is valid
- * @return true on valid index and the surfaces
+ * Grow the table of image slots
+ * @param num number of slots needed
+ * @return true on success, false otherwise
  */
-static bool _checkSurface (int index)
+static bool _growImages (int num)
 {
 
-    // check if primary surface is available
-    if (primary == NULL) {
+    imageslot_t *           table;
+    int                     max;
+    int                     i;
+
+    if (num <= nimages) {
+        return true;
+    }
+    if (num > MAX_IMAGES) {
         return false;
     }
 
-    // check if index is valid
-    if (index < 0 || index >= NUM_SURFACE) {
+    // at least double the size
+    max = MAX(num, MAX(nimages * 2, NUM_SURFACE));
+    max = MIN(max, MAX_IMAGES);
+
+    table = realloc(images, max * sizeof(imageslot_t));
+    if (table == NULL) {
         return false;
     }
 
-    // check if logo[index] is available
-    if (logo[index] == NULL) {
-        return false;
+    for (i = nimages; i < max; i++) {
+        table[i].surface    = NULL;
+        table[i].cache      = NULL;
+        table[i].state      = IMAGE_INVALID;
+        table[i].path       = NULL;
+        table[i].generation = 1;
+        table[i].next       = -1;
     }
+    images  = table;
+    nimages = max;
 
     return true;
 
@@ -173,916 +440,7222 @@ static bool _checkSurface (int index)
 
 
 /**
- * Thread function to play music
- * @param data command string
- * @return dummy
+ * Hash value of a path
+ * @param path file path
+ * @return index of the hash table
  */
-static void * _playMusic (void *data)
+static unsigned int _hashPath (const char *path)
 {
 
-    system((char *)data);
-    pthread_mutex_lock(&playLock);
-    playNow = false;
-    pthread_mutex_unlock(&playLock);
-    return (void *)NULL;
+    unsigned int            h = 2166136261u;
+
+    // FNV-1a
+    while (*path != '\0') {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+
+    return h & (IMAGE_HASH - 1);
 
 }
 
 
 /**
- * Initializing function
- * Initialize everything at once
- * @param argc number of arguments for program invokation
- * @param argv string array of the arguments
+ * Register the path of an image slot
+ * @param index index of the slot
+ * @param path file path
  */
-void init (int *argc, char ***argv)
+static void _linkPath (int index, const char *path)
 {
 
-    // create DirectFB super interface
-    initialize(argc, argv);
-
-    // create primary surface
-    createPrimarySurface();
+    unsigned int            h;
 
-    // create event buffer
-    createEventBuffer();
+    images[index].path = strdup(path);
+    if (images[index].path == NULL) {
+        return;
+    }
 
-    // initialize semaphore
-    initSemaphore();
+    h                   = _hashPath(path);
+    images[index].next  = imagehash[h];
+    imagehash[h]        = index;
 
 }
 
 
 /**
- * Initializing function
- * creates DirectFB super interface, sets the screen properties and creates
- * primary surface.
- * @param argc number of arguments for program invokation
- * @param argv string array of the arguments
+ * Unregister the path of an image slot
+ * @param index index of the slot
  */
-void initialize (int *argc, char ***argv)
+static void _unlinkPath (int index)
 {
 
-    // create DirectFB super interface
-    if (dfb == NULL) {
-        // initialize DirectFB
-        DFBCHECK(DirectFBInit(argc, argv));
-    
-        // create a super interface
-        DFBCHECK(DirectFBCreate(&dfb));
-   
-        // set fullscreen mode
-        DFBCHECK(dfb->SetCooperativeLevel(dfb, DFSCL_FULLSCREEN));
+    int *                   link;
 
-        // misc initilizing tasks
-        _initialize();
+    if (images[index].path == NULL) {
+        return;
+    }
 
-        // clear logo surface
-        _clearLogoSurface();
+    // remove from the chain
+    link = &imagehash[_hashPath(images[index].path)];
+    while (*link != -1) {
+        if (*link == index) {
+            *link = images[index].next;
+            break;
+        }
+        link = &images[*link].next;
     }
 
-}
+    free(images[index].path);
+    images[index].path = NULL;
+    images[index].next = -1;
 
+}
 
 
 /**
- * Create a primary surface
- *
+ * Move the cached image to the head of the LRU list
+ * @param c cached image
  */
-void createPrimarySurface (void)
+static void _touchCache (cachedimage_t *c)
 {
 
-    // check if the super interface has already been initialized
-    if (dfb == NULL) {
+    if (cachehead == c) {
         return;
     }
 
-    // create primary surface
-    if (primary == NULL) {
+    // unlink
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (cachetail == c)  cachetail     = c->prev;
 
-        // set properties of the primary surface
-        dsc.flags = DSDESC_CAPS;
-        dsc.caps  = DSCAPS_PRIMARY | DSCAPS_FLIPPING;
+    // link at the head
+    c->prev = NULL;
+    c->next = cachehead;
+    if (cachehead != NULL) cachehead->prev = c;
+    cachehead = c;
+    if (cachetail == NULL) cachetail = c;
 
-        // create primary surface
-        DFBCHECK(dfb->CreateSurface(dfb, &dsc, &primary));
+}
 
-        // check out the screen resolution
-        DFBCHECK(primary->GetSize(primary, &xres, &yres));
+
+/**
+ * Find the cached image of the path
+ * @param path file path
+ * @return cached image, NULL if not cached
+ */
+static cachedimage_t * _findCache (const char *path)
+{
+
+    cachedimage_t *         c;
+
+    for (c = cachehash[_hashPath(path)]; c != NULL; c = c->hnext) {
+        if (strcmp(c->path, path) == 0) {
+            return c;
+        }
     }
 
-}
+    return NULL;
 
+}
 
 
 /**
- * Create an input event buffer
- * 
+ * Add a decoded image to the cache
+ * The cache takes its own reference of the surface.
+ * @param path file path
+ * @param mtime modification time of the file
+ * @param surface decoded image
+ * @param desc description of the surface
+ * @param map mapped raw image file, NULL if decoded
+ * @param mapsize size of the mapping
+ * @return cached image, NULL on failure
  */
-void createEventBuffer (void)
+static cachedimage_t * _addCache (const char *path, time_t mtime,
+                                  IDirectFBSurface *surface,
+                                  const DFBSurfaceDescription *desc,
+                                  void *map, size_t mapsize)
 {
 
-    // check if the super interface has already been initialized
-    if (dfb == NULL) {
-        return;
-    }
+    cachedimage_t *         c;
+    DFBSurfacePixelFormat   format;
+    unsigned int            h;
+    int                     w;
+    int                     ht;
 
-    // create an button event buffer
-    if (eventbuffer == NULL) {
-        DFBCHECK(dfb->CreateInputEventBuffer(dfb, DICAPS_ALL, DFB_FALSE, &eventbuffer));
+    c = malloc(sizeof(cachedimage_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->path = strdup(path);
+    if (c->path == NULL) {
+        free(c);
+        return NULL;
     }
 
-}
+    // size of the pixels
+    DFBCHECK(surface->GetSize(surface, &w, &ht));
+    DFBCHECK(surface->GetPixelFormat(surface, &format));
+
+    surface->AddRef(surface);
+    c->mtime   = mtime;
+    c->surface = surface;
+    c->desc    = *desc;
+    c->map     = map;
+    c->mapsize = mapsize;
+    c->bytes   = (size_t)w * ht * DFB_BYTES_PER_PIXEL(format);
+    c->refs    = 0;
+    c->pinned  = false;
+    c->stale   = false;
+
+    // hash chain
+    h            = _hashPath(path);
+    c->hnext     = cachehash[h];
+    cachehash[h] = c;
 
+    // LRU list
+    c->prev = NULL;
+    c->next = NULL;
+    _touchCache(c);
+
+    cachebytes += c->bytes;
+
+    return c;
+
+}
 
 
 /**
- * Initialize the semaphores to syncronize
- *
+ * Remove the cached image from the hash table
+ * It can no longer be found, but stays until its users release it.
+ * @param c cached image
  */
-void initSemaphore (void)
+static void _unhashCache (cachedimage_t *c)
 {
 
-    static bool             check = false;
+    cachedimage_t **        link;
 
-    // this should be processed just onece
-    if (check) {
+    if (c->stale) {
         return;
-    } else {
-        check = true;
     }
 
-    // initialize semapohores
-    sem_init(&positiondet, 0, 0);
+    for (link = &cachehash[_hashPath(c->path)]; *link != NULL;
+                                            link = &(*link)->hnext) {
+        if (*link == c) {
+            *link = c->hnext;
+            break;
+        }
+    }
+    c->stale = true;
 
 }
 
 
-
 /**
- * Wait for an input event
- * @param e variable to stor input event
- * @return true on valid event, false if not
+ * Remove the cached image and release the surface
+ * @param c cached image
  */
-bool getInputEvent (DFBInputEvent *e)
+static void _destroyCache (cachedimage_t *c)
 {
 
-    // check if event buffer is initialized
-    if (eventbuffer == NULL) {
-        return false;
-    }
+    _unhashCache(c);
 
-    // wait for an input event
-    eventbuffer->WaitForEvent(eventbuffer);
+    // LRU list
+    if (c->prev != NULL) c->prev->next = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    if (cachehead == c)  cachehead     = c->next;
+    if (cachetail == c)  cachetail     = c->prev;
 
-    // retrieve the event
-    if (eventbuffer->GetEvent(eventbuffer, DFB_EVENT(e)) != DFB_OK) {
-        return false;
+    cachebytes -= c->bytes;
+    c->surface->Release(c->surface);
+    if (c->map != NULL) {
+        _retireMap(c->map, c->mapsize);
     }
-
-    return true;
+    free(c->path);
+    free(c);
 
 }
 
 
-
 /**
- * Handling button event
- * @param e input event
- * @return true on touch on/off event, false if not
+ * Unmap the raw image file after the next flip
+ * Queued commands may still refer to the surface on the mapping.
+ * The image lock must be held by the caller.
+ * @param map mapped raw image file
+ * @param mapsize size of the mapping
  */
-bool handleButton (DFBInputEvent *e)
+static void _retireMap (void *map, size_t mapsize)
 {
 
-    struct timespec         curtime;
-    long                    duration;
+    rawmap_t *              r;
 
-    // touch on/off event
-    switch (e->type) {
-        case DIET_BUTTONPRESS:
-            clock_gettime(CLOCK_REALTIME, &lastTouch);
-            tstate = TOUCHED;
-            return true;
-        case DIET_BUTTONRELEASE:
-            clock_gettime(CLOCK_REALTIME, &curtime);
-            duration  = curtime.tv_nsec - lastTouch.tv_nsec;
-            duration += (curtime.tv_sec - lastTouch.tv_sec) * 1000000000;
-            if (ignoreItrvl > duration) {
-                // chuttering
-                break;
-            }
-            tstate = RELEASED;
-            return true;
-        default:
-            break;
+    // leave it mapped rather than unmapping it too early
+    r = malloc(sizeof(rawmap_t));
+    if (r == NULL) {
+        return;
     }
 
-    return false;
+    r->addr = map;
+    r->size = mapsize;
+    r->next = retired;
+    retired = r;
 
 }
 
 
-
 /**
- * Handling current position
- * @param e input event
- * @return true on axis event or false otherwise
+ * Unmap the raw image files released
+ * They are kept while a context holds recorded commands, which may blit
+ * from a surface on a mapping.
  */
-bool handleAxes (DFBInputEvent *e)
+static void _unmapRetired (void)
 {
 
-    static unsigned int     st = 0;
-    static int              x, y;
-    int                     i;
+    rawmap_t *              r = NULL;
+    rawmap_t *              next;
 
-    // touch off syncronization
-    if (tstate == RELEASED) {
-        samples = 0;
+    pthread_mutex_lock(&imageLock);
+    if (heldSources == 0) {
+        r       = retired;
+        retired = NULL;
     }
+    pthread_mutex_unlock(&imageLock);
 
-    // not likely but just in case
-    if (e->type != DIET_AXISMOTION) {
-        return false;
+    if (r == NULL) {
+        return;
     }
 
-    // check value
-    switch (e->axis) {
-        case DIAI_X:    // X axis
-            x   = e->axisabs;
-            st |= 1;
-            break;
-        case DIAI_Y:    // Y axis
-            y   = e->axisabs;
-            st |= 2;
-            break;
-        default:
-            return false;
+    // wait for the blits from the surfaces
+    DFBCHECK(dfb->WaitIdle(dfb));
+
+    for (; r != NULL; r = next) {
+        next = r->next;
+        munmap(r->addr, r->size);
+        free(r);
     }
 
-    // put position into the array
-    if (st == 3) {
+}
 
-        // put sampled position
-        positions[samples].x = x;
-        positions[samples].y = y;
 
-        // reset
-        st = 0;
+/**
+ * Drop a reference from an image slot
+ * @param c cached image
+ */
+static void _unrefCache (cachedimage_t *c)
+{
 
-        // update number of samples
-        samples++;
+    c->refs--;
 
-        // reach max number of samples
-        if (samples == POSSAMPLES) {
+    // replaced by a newer file
+    if (c->stale && c->refs == 0) {
+        _destroyCache(c);
+    }
 
-            // calculate average
-            x = 0;
-            y = 0;
-            for (i = 0; i < POSSAMPLES; i++) {
-                x += positions[i].x;
-                y += positions[i].y;
-            }
-            x /= POSSAMPLES;
-            y /= POSSAMPLES;
+}
 
-            // update current position
-            curpos.x = (int)(((x - CalX1) * (xres - 1)) / CalXR);
-            curpos.y = (int)(((y - CalY1) * (yres - 1)) / CalYR);
 
-            // position determinating sync
-            sem_post(&positiondet);
+/**
+ * Evict the least recently used images until the cache fits the budget
+ * Images in use by the slots or pinned are kept.
+ */
+static void _trimCache (void)
+{
 
-            // reset number of samples
-            samples = 0;
+    cachedimage_t *         c;
+    cachedimage_t *         prev;
 
+    for (c = cachetail; c != NULL && cachebytes > cachebudget; c = prev) {
+        prev = c->prev;
+        if (c->refs == 0 && ! c->pinned) {
+            _destroyCache(c);
         }
     }
 
-    return true;
-
 }
 
 
 /**
- * Input event loop
- * @return axis, negative value on error
+ * Check if the primary surface is available
+ * and the index is valid
+ * @return true on valid index and primary surface
  */
-position_t eventLoop (void)
+static bool _checkIndex (int index)
 {
 
-    DFBInputEvent           e;
-    int                     val;
+    // check if primary surface is available
+    if (primary == NULL) {
+        return false;
+    }
 
-    while (getInputEvent(&e)) {
+    // check if index is valid
+    if (index < 0 || index >= MAX_IMAGES) {
+        return false;
+    }
 
-        // handle key event
-        handleButton(&e);
+    return true;
 
-        // handle axis event
-        handleAxes(&e);
+}
 
-        // break if released
-        if (tstate == RELEASED) {
-            break;
-        }
 
-        // check if axis is determined
-        sem_getvalue(&positiondet, &val);
-        if (val > 0) {
-            sem_wait(&positiondet);
-            break;
-        }
+/**
+ * Check if the primary surface and the image are available
+ * and the index is valid
+ * @return true on valid index and the surfaces
+ */
+static bool _checkSurface (int index)
+{
+
+    // check if primary surface is available
+    if (primary == NULL) {
+        return false;
     }
 
-    return curpos;
+    // check if index is valid and the image is available
+    pthread_mutex_lock(&imageLock);
+    if (index < 0 || index >= nimages || images[index].state != IMAGE_READY) {
+        pthread_mutex_unlock(&imageLock);
+        return false;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return true;
 
 }
 
 
 /**
- * Return touch state
- * @return the current touch state
+ * Check if two regions overlap or touch each other
+ * @return true if the regions can be merged without a gap
  */
-TouchState getTouchState (void)
+static inline bool _touchRegion (const DFBRegion *a, const DFBRegion *b)
 {
 
-    return tstate;
+    return a->x1 <= b->x2 + 1 && b->x1 <= a->x2 + 1 &&
+           a->y1 <= b->y2 + 1 && b->y1 <= a->y2 + 1;
 
 }
 
 
 /**
- * Flip the buffer
+ * Area of a region
  */
-void flip (void)
+static inline long _regionArea (const DFBRegion *r)
 {
 
-    if (primary == NULL) {
-        return;
-    }
-    DFBCHECK(primary->Flip(primary, NULL, DSFLIP_WAITFORSYNC));
+    return (long)(r->x2 - r->x1 + 1) * (r->y2 - r->y1 + 1);
 
 }
 
 
 /**
- * Clear the screen
+ * Extend the region to include another one
+ * @param r region to extend
+ * @param a region to include
  */
-void clearScreen (void)
+static inline void _unionRegion (DFBRegion *r, const DFBRegion *a)
 {
 
-    if (primary == NULL) {
-        return;
-    }
-
-    DFBCHECK(primary->SetColor(primary, 0, 0, 0, 0xff));
-    DFBCHECK(primary->FillRectangle(primary, 0, 0, xres, yres));
+    if (a->x1 < r->x1) r->x1 = a->x1;
+    if (a->y1 < r->y1) r->y1 = a->y1;
+    if (a->x2 > r->x2) r->x2 = a->x2;
+    if (a->y2 > r->y2) r->y2 = a->y2;
 
 }
 
 
 /**
- * Change current color of the primary surface
- * @param c color
+ * Add a damaged region of the back buffer
+ * Overlapping or adjacent regions are merged together, and the region
+ * which grows least absorbs the new one when the list is full.
+ * @param x1 left
+ * @param y1 top
+ * @param x2 right (inclusive)
+ * @param y2 bottom (inclusive)
  */
-void setColor (int r, int g, int b, int a)
+static void _addDamage (int x1, int y1, int x2, int y2)
 {
 
-    color_t                 c = {r, g, b, a};
+    DFBRegion               r;
+    DFBRegion               u;
+    long                    cost;
+    long                    mincost;
+    int                     best;
+    int                     i;
 
-    if (primary == NULL) {
+    // clip to the screen
+    r.x1 = (x1 < 0) ? 0 : x1;
+    r.y1 = (y1 < 0) ? 0 : y1;
+    r.x2 = (x2 >= xres) ? xres - 1 : x2;
+    r.y2 = (y2 >= yres) ? yres - 1 : y2;
+    if (r.x1 > r.x2 || r.y1 > r.y2) {
         return;
     }
 
-    //
-    DFBCHECK(primary->SetColor(primary, c.r, c.g, c.b, c.a));
+    // merge with overlapping or adjacent regions
+    i = 0;
+    while (i < ndamage) {
+        if (_touchRegion(&damage[i], &r)) {
+            _unionRegion(&r, &damage[i]);
+            damage[i] = damage[--ndamage];
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+
+    // append as a new region
+    if (ndamage < MAX_DAMAGE) {
+        damage[ndamage++] = r;
+        return;
+    }
+
+    // list is full, find the region which grows least
+    best    = 0;
+    mincost = LONG_MAX;
+    for (i = 0; i < ndamage; i++) {
+        u = damage[i];
+        _unionRegion(&u, &r);
+        cost = _regionArea(&u) - _regionArea(&damage[i]);
+        if (cost < mincost) {
+            mincost = cost;
+            best    = i;
+        }
+    }
 
-    // save current color
-    ccolor = c;
+    // grown region may touch the others, so add it again
+    _unionRegion(&r, &damage[best]);
+    damage[best] = damage[--ndamage];
+    _addDamage(r.x1, r.y1, r.x2, r.y2);
 
 }
 
 
 /**
- * Fill the screen with a color
- * @param c color
+ * Add a damaged rectangle of the back buffer
+ * @param x left
+ * @param y top
+ * @param w width
+ * @param h height
  */
-void fillScreen (int r, int g, int b, int a)
+static void _damageRect (int x, int y, int w, int h)
 {
 
-    color_t                 c = {r, g, b, a};
-
-    if (primary == NULL) {
+    if (w <= 0 || h <= 0) {
         return;
     }
 
-    DFBCHECK(primary->SetColor(primary, c.r, c.g, c.b, c.a));
-    DFBCHECK(primary->FillRectangle(primary, 0, 0, xres, yres));
+    _addDamage(x, y, x + w - 1, y + h - 1);
 
 }
 
 
 /**
- * Release all the resource
+ * Add the region of a text as damaged
+ * The font must be locked by the caller.
+ * @param f font
+ * @param text text to draw
+ * @param p position
+ * @param flg alignment flags
  */
-void release (void)
+static void _damageText (IDirectFBFont *f, const char *text,
+                            position_t p, DFBSurfaceTextFlags flg)
 {
 
-    int                     i;
-
-    // font
-    if (font != NULL) {
-        font->Release(font);
-        font = NULL;
-    }
-
-    // event buffer
-    if (eventbuffer != NULL) {
-        eventbuffer->Release(eventbuffer);
-        eventbuffer = NULL;
+    DFBRectangle            logical;
+    DFBRectangle            ink;
+    DFBRegion               r;
+    DFBRegion               i;
+    int                     width;
+    int                     ascender;
+    int                     descender;
+
+    // extents relative to the origin on the base line
+    DFBCHECK(f->GetStringExtents(f, text, -1, &logical, &ink));
+    DFBCHECK(f->GetStringWidth(f, text, -1, &width));
+    DFBCHECK(f->GetAscender(f, &ascender));
+    DFBCHECK(f->GetDescender(f, &descender));
+
+    r.x1 = logical.x;
+    r.y1 = logical.y;
+    r.x2 = logical.x + logical.w - 1;
+    r.y2 = logical.y + logical.h - 1;
+    if (ink.w > 0 && ink.h > 0) {
+        i.x1 = ink.x;
+        i.y1 = ink.y;
+        i.x2 = ink.x + ink.w - 1;
+        i.y2 = ink.y + ink.h - 1;
+        _unionRegion(&r, &i);
     }
 
-    // logo buffer
-    for (i = 0; i < NUM_SURFACE; i++) {
-        if (logo[i] != NULL) {
-            logo[i]->Release(logo[i]);
-            logo[i] = NULL;
-        }
+    // horizontal alignment
+    if (flg & DSTF_RIGHT) {
+        p.x -= width;
+    } else
+    if (flg & DSTF_CENTER) {
+        p.x -= width / 2;
     }
 
-    // primary surface
-    if (primary != NULL) {
-        primary->Release(primary);
-        primary = NULL;
+    // vertical alignment, descender is negative
+    if (flg & DSTF_TOP) {
+        p.y += ascender;
+    } else
+    if (flg & DSTF_BOTTOM) {
+        p.y += descender;
     }
 
-    // super interface
-    if (dfb != 0) {
-        dfb->Release(dfb);
-        dfb = NULL;
-    }
+    _addDamage(p.x + r.x1, p.y + r.y1, p.x + r.x2, p.y + r.y2);
 
 }
 
 
+/**
+ * Forget the state of the primary surface
+ */
+static void _invalidateState (void)
+{
+
+    stcolorValid = false;
+    stblitValid  = false;
+
+}
+
 
 /**
- * Release the image
- * @param index index of the array for logo surface
+ * Set the color of the primary surface unless already set
+ * @param c color
  */
-void releaseImage (int index)
+static void _applyColor (color_t c)
 {
 
-    // check if index is valid
-    if (! _checkIndex(index)) {
+    if (stcolorValid && stcolor.r == c.r && stcolor.g == c.g &&
+                        stcolor.b == c.b && stcolor.a == c.a) {
+        ststats.skipped++;
         return;
     }
 
-    // release the surface if allocated
-    if (logo[index] != NULL) {
-        logo[index]->Release(logo[index]);
-        logo[index] = NULL;
-    }
+    DFBCHECK(primary->SetColor(primary, c.r, c.g, c.b, c.a));
+    stcolor      = c;
+    stcolorValid = true;
+    ststats.issued++;
 
 }
 
 
 /**
- * Read the image
- * @param index index of the array for logo surface
- * @param path file path
- * @return true on success, false otherwise
+ * Set the blitting flags of the primary surface unless already set
+ * @param flags blitting flags
  */
-bool readImage (int index, const char *path)
+static void _applyBlittingFlags (DFBSurfaceBlittingFlags flags)
 {
 
-    IDirectFBImageProvider *provider;
-
-    // check primary surface and index
-    if (! _checkIndex(index)) {
-        return false;
+    if (stblitValid && stblit == flags) {
+        ststats.skipped++;
+        return;
     }
 
-    // check if logo is available
-    if (logo[index] != NULL) {
-        releaseImage(index);
-    }
+    DFBCHECK(primary->SetBlittingFlags(primary, flags));
+    stblit      = flags;
+    stblitValid = true;
+    ststats.issued++;
 
-    // create image provider
-    DFBCHECK(dfb->CreateImageProvider(dfb, path, &provider));
+}
 
-    // obtain information of the image
-    DFBCHECK(provider->GetSurfaceDescription(provider, &ldsc[index]));
 
-    // create surface using image description
-    DFBCHECK(dfb->CreateSurface(dfb, &ldsc[index], &logo[index]));
+/**
+ * Allocate a new command at the end of the buffer
+ * The deferred buffer is submitted to make room if it cannot grow.
+ * @param b command buffer
+ * @param kind kind of the command
+ * @return new command, NULL if it should be drawn immediately
+ */
+static command_t * _newCommand (cmdbuf_t *b, CommandKind kind)
+{
 
-    // render to the surface
-    DFBCHECK(provider->RenderTo(provider, logo[index], NULL));
+    command_t *             c;
+    command_t *             cmds;
+    int                     max;
+
+    // grow the buffer
+    if (b->num == b->max) {
+        max  = (b->max == 0) ? CMDBUF_INITIAL : b->max * 2;
+        cmds = realloc(b->cmds, max * sizeof(command_t));
+        if (cmds != NULL) {
+            b->cmds = cmds;
+            b->max  = max;
+        } else if (b == &cmdbuf) {
+            // out of memory, draw the queued commands now
+            _flushCommands();
+            if (b->max == 0) {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+    }
 
-    // release provider
-    provider->Release(provider);
+    c         = &b->cmds[b->num++];
+    c->kind   = kind;
+    c->alpha  = false;
+    c->done   = false;
+    c->source = NULL;
 
-    return true;
+    return c;
 
 }
 
 
-
 /**
- * Render the image at top left coner
- * @param index index of the array for logo surface
- * @param alpha enable alpha blending on true
+ * Record a command into the context of the thread or the deferred buffer
+ * A thread with a context never draws immediately, so its commands are
+ * dropped if they cannot be recorded.
+ * @param kind kind of the command
+ * @return new command, NULL if it should be drawn immediately or dropped
  */
-void renderImage (int index, bool alpha)
+static command_t * _record (CommandKind kind)
 {
 
-    // check if primary surface is available
-    if (! _checkSurface(index)) {
-        return;
-    }
+    command_t *             c;
 
-    // set setting of blending
-    if (alpha) {
-        DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_BLEND_ALPHACHANNEL));
+    if (context != NULL) {
+        c = _newCommand(&context->buf, kind);
+        if (c != NULL) {
+            c->color = context->color;
+        }
+        return c;
     }
 
-    DFBCHECK(primary->Blit(primary, logo[index], NULL, 0, 0));
+    if (deferred) {
+        c = _newCommand(&cmdbuf, kind);
+        if (c != NULL) {
+            c->color = ccolor;
+        }
+        return c;
+    }
 
-    // restore setting of blending
-    DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_NOFX));
+    return NULL;
 
 }
 
 
-
 /**
- * Render the image at the position
- * @param index index of the array for logo surface
- * @param p position to render the image 
- * @param alpha enable alpha blending on true
+ * Set the bounding box of a queued command and mark it as damaged
+ * Commands of a context are marked when they are merged at flip().
+ * @param c command
+ * @param x1 left
+ * @param y1 top
+ * @param x2 right (inclusive)
+ * @param y2 bottom (inclusive)
  */
-void putImage (int index, position_t p, bool alpha)
+static void _queued (command_t *c, int x1, int y1, int x2, int y2)
 {
 
-    // check if primary surface is available
-    if (! _checkSurface(index)) {
-        return;
-    }
+    c->bbox.x1 = x1;
+    c->bbox.y1 = y1;
+    c->bbox.x2 = x2;
+    c->bbox.y2 = y2;
 
-    // set setting of blending
-    if (alpha) {
-        DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_BLEND_ALPHACHANNEL));
+    if (context == NULL) {
+        _addDamage(x1, y1, x2, y2);
     }
 
-    DFBCHECK(primary->Blit(primary, logo[index], NULL, p.x, p.y));
-
-    // restore setting of blending
-    DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_NOFX));
-
 }
 
 
 /**
- * Render the image with regions
- * @param index index of the array for logo surface
- * @param from region of the source image
- * @param to region of the destination surface
- * @param alpha enable alpha blending on true
+ * Drop the command recorded last by the calling thread
  */
-void stretchImage (int index, region_t from, region_t to, bool alpha)
+static void _unrecord (void)
 {
 
-    // check if primary surface is available
-    if (! _checkSurface(index)) {
-        return;
+    if (context != NULL) {
+        context->buf.num--;
+    } else {
+        cmdbuf.num--;
     }
 
-    // set setting of blending
-    if (alpha) {
-        DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_BLEND_ALPHACHANNEL));
-    }
+}
 
-    DFBCHECK(primary->StretchBlit(primary, logo[index], &from, &to));
 
-    // restore setting of blending
-    DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_NOFX));
+/**
+ * Take a reference to the source surface of the recorded command
+ * DirectFB does not count the references atomically, so they are taken
+ * and dropped under the image lock, flip() holds it to release them.
+ * The image lock must be held by the caller.
+ * @param c command
+ * @param s source surface
+ */
+static void _holdSource (command_t *c, IDirectFBSurface *s)
+{
+
+    c->source = s;
+    s->AddRef(s);
+    heldSources++;
 
 }
 
 
 /**
- * Draw rectangle on primary surface
- * @param r region
- * @param fill fill the rectangle on true
+ * Check if two commands can be drawn with the same state
+ * @return true if the commands can be put into a batch
  */
-void rectangle (region_t r, bool fill)
+static inline bool _sameState (const command_t *a, const command_t *b)
 {
 
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return;
+    if (a->kind != b->kind) {
+        return false;
     }
 
-    // draw rectangle
-    if (fill) {
-        DFBCHECK(primary->FillRectangle(primary, r.x, r.y, r.w, r.h));
-    } else {
-        DFBCHECK(primary->DrawRectangle(primary, r.x, r.y, r.w, r.h));
+    // blits depend on the source and blending
+    if (a->kind == CMD_BLIT || a->kind == CMD_STRETCH) {
+        return a->source == b->source && a->alpha == b->alpha;
     }
 
+    // others depend on the color
+    return a->color.r == b->color.r && a->color.g == b->color.g &&
+           a->color.b == b->color.b && a->color.a == b->color.a;
+
 }
 
 
 /**
- * Draw line
- * @param from starting point
- * @param to terminating point
+ * Check if two regions overlap
+ * @return true on overlap
  */
-void line (position_t from, position_t to)
+static inline bool _overlapRegion (const DFBRegion *a, const DFBRegion *b)
 {
 
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return;
-    }
-
-    DFBCHECK(primary->DrawLine(primary, from.x, from.y, to.x, to.y));
+    return a->x1 <= b->x2 && b->x1 <= a->x2 &&
+           a->y1 <= b->y2 && b->y1 <= a->y2;
 
 }
 
 
 /**
- * Draw triangle
- * @param p1
- * @param p2
- * @param p3
+ * Set the state of the primary surface for a batch
+ * @param key first command of the batch
  */
-void triangle (position_t p1, position_t p2, position_t p3)
+static void _applyState (const command_t *key)
 {
 
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return;
+    if (key->kind == CMD_BLIT || key->kind == CMD_STRETCH) {
+        _applyBlittingFlags(key->alpha ? DSBLIT_BLEND_ALPHACHANNEL
+                                       : DSBLIT_NOFX);
+    } else {
+        _applyColor(key->color);
     }
 
-    DFBCHECK(primary->FillTriangle(primary, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y));
-
 }
 
 
 /**
- * Get screen size 
- * @return screen size
+ * Put a command into the scratch arrays
+ * @param c command
+ * @param n index in the scratch arrays
  */
-scsize_t getSize (void)
+static void _batchCommand (const command_t *c, int n)
 {
 
-    scsize_t            res = {-1 , -1};
-
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return res;
+    switch (c->kind) {
+        case CMD_LINE:
+            batch.lines[n] = c->g.line;
+            break;
+        case CMD_FILLRECT:
+            batch.rects[n] = c->g.rect;
+            break;
+        case CMD_TRIANGLE:
+            batch.tris[n]  = c->g.tri;
+            break;
+        case CMD_BLIT:
+            batch.rects[n] = c->g.blit.from;
+            batchpts[n].x  = c->g.blit.to.x;
+            batchpts[n].y  = c->g.blit.to.y;
+            break;
+        default:
+            batchcmds[n]   = c;
+            break;
     }
 
-    res.w = xres;
-    res.h = yres;
-
-    return res;
-
 }
 
 
 /**
- * Get surface size 
- * @return surface size 
+ * Draw the commands in the scratch arrays
+ * @param key first command of the batch
+ * @param n number of commands
  */
-scsize_t getSurfaceSize (int index)
+static void _drawBatch (const command_t *key, int n)
 {
 
-    scsize_t            s = {-1, -1};
+    const command_t *       c;
+    int                     i;
 
-    // check if logo surface is available
-    if (! _checkSurface(index)) {
-        return s;
+    if (n == 0) {
+        return;
     }
 
-    DFBCHECK(logo[index]->GetSize(logo[index], &s.w, &s.h));
-
-    return s;
+    switch (key->kind) {
+        case CMD_LINE:
+            DFBCHECK(primary->DrawLines(primary, batch.lines, n));
+            break;
+        case CMD_FILLRECT:
+            DFBCHECK(primary->FillRectangles(primary, batch.rects, n));
+            break;
+        case CMD_TRIANGLE:
+            DFBCHECK(primary->FillTriangles(primary, batch.tris, n));
+            break;
+        case CMD_BLIT:
+            DFBCHECK(primary->BatchBlit(primary, key->source,
+                                            batch.rects, batchpts, n));
+            break;
+        case CMD_DRAWRECT:
+            for (i = 0; i < n; i++) {
+                c = batchcmds[i];
+                DFBCHECK(primary->DrawRectangle(primary, c->g.rect.x,
+                                c->g.rect.y, c->g.rect.w, c->g.rect.h));
+            }
+            break;
+        case CMD_STRETCH:
+            for (i = 0; i < n; i++) {
+                c = batchcmds[i];
+                DFBCHECK(primary->StretchBlit(primary, c->source,
+                                &c->g.blit.from, &c->g.blit.to));
+            }
+            break;
+    }
 
 }
 
 
 /**
- * Set font to the primary surface
- * @param path path to the font file
- * @param size font size
- * @return true on success, false otherwise
+ * Submit the commands to DirectFB
+ * Commands with the same state are put into a batch. A command is moved
+ * ahead only if it does not overlap the commands left behind, so the
+ * result is the same as drawing them in order.
+ * @param b command buffer
  */
-bool setFont (const char * path, int size)
+static void _submitCommands (cmdbuf_t *b)
 {
 
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return false;
-    }
+    const command_t *       key;
+    command_t *             c;
+    DFBRegion               barrier;
+    bool                    blocked;
+    int                     i;
+    int                     j;
+    int                     n;
 
-    // check if the font has already set
-    if (font != NULL) {
-        unsetFont();
+    PROF_SCOPE(submit);
+
+    if (b->num == 0) {
+        return;
+    }
+
+    for (i = 0; i < b->num; i++) {
+
+        // first command left becomes the key of a new batch
+        key = &b->cmds[i];
+        if (key->done) {
+            continue;
+        }
+        _applyState(key);
+
+        // collect the commands with the same state
+        n       = 0;
+        blocked = false;
+        for (j = i; j < b->num; j++) {
+            c = &b->cmds[j];
+            if (c->done) {
+                continue;
+            }
+
+            if (_sameState(key, c) &&
+                    ! (blocked && _overlapRegion(&barrier, &c->bbox))) {
+                if (n == BATCH_SIZE) {
+                    _drawBatch(key, n);
+                    n = 0;
+                }
+                _batchCommand(c, n++);
+                c->done = true;
+                continue;
+            }
+
+            // later commands must not pass over the one left behind
+            if (blocked) {
+                _unionRegion(&barrier, &c->bbox);
+            } else {
+                barrier = c->bbox;
+                blocked = true;
+            }
+
+            // nothing can pass any more
+            if (barrier.x1 <= 0 && barrier.y1 <= 0 &&
+                    barrier.x2 >= xres - 1 && barrier.y2 >= yres - 1) {
+                break;
+            }
+        }
+        _drawBatch(key, n);
+    }
+
+    // release the sources and empty the buffer
+    _discardCommands(b);
+
+}
+
+
+/**
+ * Discard the commands in the buffer
+ * @param b command buffer
+ */
+static void _discardCommands (cmdbuf_t *b)
+{
+
+    int                     i;
+
+    if (b->num == 0) {
+        return;
+    }
+
+    // references may be taken by the contexts meanwhile
+    pthread_mutex_lock(&imageLock);
+    for (i = 0; i < b->num; i++) {
+        if (b->cmds[i].source != NULL) {
+            b->cmds[i].source->Release(b->cmds[i].source);
+            heldSources--;
+        }
+    }
+    pthread_mutex_unlock(&imageLock);
+    b->num = 0;
+
+}
+
+
+/**
+ * Draw the deferred commands before drawing immediately
+ */
+static void _flushCommands (void)
+{
+
+    _submitCommands(&cmdbuf);
+
+}
+
+
+/**
+ * Draw the commands submitted by the contexts in order of submission
+ */
+static void _mergeContexts (void)
+{
+
+    ctxbatch_t *            list;
+    ctxbatch_t *            prev = NULL;
+    ctxbatch_t *            b;
+    int                     i;
+
+    // take all the batches, they are pushed in reverse order
+    list = __atomic_exchange_n(&submitted, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        b       = list;
+        list    = b->next;
+        b->next = prev;
+        prev    = b;
+    }
+
+    for (b = prev; b != NULL; b = b->next) {
+        for (i = 0; i < b->buf.num; i++) {
+            _addDamage(b->buf.cmds[i].bbox.x1, b->buf.cmds[i].bbox.y1,
+                       b->buf.cmds[i].bbox.x2, b->buf.cmds[i].bbox.y2);
+        }
+        _submitCommands(&b->buf);
+    }
+
+    _freeBatches(prev);
+
+}
+
+
+/**
+ * Free a list of the batches submitted by the contexts
+ * @param b first batch of the list
+ */
+static void _freeBatches (ctxbatch_t *b)
+{
+
+    ctxbatch_t *            next;
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        _discardCommands(&b->buf);
+        free(b->buf.cmds);
+        free(b);
+    }
+
+}
+
+
+/**
+ * Get a sample of a channel in the WAV data
+ * @param p first byte of the frame
+ * @param ch channel
+ * @param bits bits per sample
+ * @return signed 16 bit sample
+ */
+static inline int _wavSample (const uint8_t *p, int ch, int bits)
+{
+
+    switch (bits) {
+    case 8:
+        p += ch;
+        return (p[0] - 128) * 256;
+    case 16:
+        p += ch * 2;
+        return (int16_t)(p[0] | p[1] << 8);
+    case 24:
+        p += ch * 3;
+        return (int16_t)(p[1] | p[2] << 8);
+    default:
+        p += ch * 4;
+        return (int16_t)(p[2] | p[3] << 8);
+    }
+
+}
+
+
+/**
+ * Convert the WAV samples into the format of the audio device
+ * Mono is copied to both channels, and the rate is converted linearly.
+ * @param d decoder
+ * @param first frame of the WAV samples at the chunk
+ * @param avail frames in the chunk
+ * @param out samples converted
+ * @param count frames to convert from the position of the decoder
+ */
+static void _convertWav (const decoder_t *d, long first, long avail,
+                                                int16_t *out, long count)
+{
+
+    const uint8_t *         p;
+    int64_t                 src;
+    long                    stride = d->channels * (d->bits / 8);
+    long                    i;
+    long                    j;
+    int                     frac;
+    int                     ch;
+    int                     a;
+    int                     b;
+
+    for (i = 0; i < count; i++) {
+        // position in the chunk, and the fraction to the next frame
+        src  = (int64_t)(d->pos + i) * d->rate;
+        j    = (long)(src / audioRate) - first;
+        frac = (int)(src % audioRate);
+        p    = d->chunk + j * stride;
+
+        for (ch = 0; ch < AUDIO_CHANNELS; ch++) {
+            a = _wavSample(p, MIN(ch, d->channels - 1), d->bits);
+            b = a;
+            if (frac != 0 && j + 1 < avail) {
+                b = _wavSample(p + stride, MIN(ch, d->channels - 1), d->bits);
+            }
+            out[i * AUDIO_CHANNELS + ch] =
+                        (int16_t)(a + (int64_t)(b - a) * frac / audioRate);
+        }
+    }
+
+}
+
+
+/**
+ * Read the header of a WAV file
+ * @param d decoder with the file opened
+ * @return true on success, false on failure
+ */
+static bool _openWav (decoder_t *d)
+{
+
+    uint8_t                 h[24];
+    off_t                   off    = 12;
+    off_t                   end;
+    uint32_t                size   = 0;
+    int                     format = 0;
+
+    if (pread(d->fd, h, 12, 0) != 12 ||
+            memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    // walk through the chunks until the samples
+    while (pread(d->fd, h, 8, off) == 8) {
+        size = h[4] | h[5] << 8 | h[6] << 16 | (uint32_t)h[7] << 24;
+
+        if (memcmp(h, "fmt ", 4) == 0 && size >= 16) {
+            if (pread(d->fd, h + 8, 16, off + 8) != 16) {
+                return false;
+            }
+            format      = h[8]  | h[9]  << 8;
+            d->channels = h[10] | h[11] << 8;
+            d->rate     = h[12] | h[13] << 8 | h[14] << 16 | (uint32_t)h[15] << 24;
+            d->bits     = h[22] | h[23] << 8;
+        } else
+        if (memcmp(h, "data", 4) == 0) {
+            d->data = off + 8;
+            break;
+        }
+        off += 8 + size + (size & 1);
+    }
+
+    // PCM of 8, 16, 24 or 32 bits, including the extensible format
+    if (d->data == 0 || (format != 1 && format != 0xfffe) ||
+            d->channels < 1 || d->rate == 0 ||
+            (d->bits != 8 && d->bits != 16 && d->bits != 24 && d->bits != 32)) {
+        return false;
+    }
+    end       = lseek(d->fd, 0, SEEK_END);
+    d->frames = MIN((off_t)size, end - d->data) / (d->channels * (d->bits / 8));
+
+    // chunk covering the WAV samples of a stream buffer
+    d->chunkFrames = (long)((int64_t)STREAM_FRAMES * d->rate / audioRate) + 3;
+    d->chunk       = malloc(d->chunkFrames * d->channels * (d->bits / 8));
+
+    return d->chunk != NULL;
+
+}
+
+
+/**
+ * Set up libmpg123 to decode into the format of the audio device
+ * @param d decoder with the file opened
+ * @return true on success, false on failure
+ */
+static bool _openMp3 (decoder_t *d)
+{
+
+    int                     err;
+
+    d->mh = mpg123_new(NULL, &err);
+    if (d->mh == NULL) {
+        return false;
+    }
+
+    if (mpg123_param(d->mh, MPG123_ADD_FLAGS, MPG123_FORCE_STEREO, 0) != MPG123_OK ||
+        mpg123_param(d->mh, MPG123_FORCE_RATE, audioRate, 0) != MPG123_OK ||
+        mpg123_format_none(d->mh) != MPG123_OK ||
+        mpg123_format(d->mh, audioRate, MPG123_STEREO,
+                                    MPG123_ENC_SIGNED_16) != MPG123_OK ||
+        mpg123_open_fd(d->mh, d->fd) != MPG123_OK) {
+        fprintf(stderr, "libmpg123: %s\n", mpg123_strerror(d->mh));
+        mpg123_delete(d->mh);
+        d->mh = NULL;
+        return false;
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Open a WAV or MP3 file to decode
+ * @param path path to the file
+ * @param d decoder
+ * @return true on success, false on failure
+ */
+static bool _openDecoder (const char *path, decoder_t *d)
+{
+
+    size_t                  len = strlen(path);
+    bool                    rtn = false;
+
+    memset(d, 0, sizeof(decoder_t));
+    d->fd = open(path, O_RDONLY);
+    if (d->fd < 0) {
+        return false;
+    }
+
+    if (len > 4 && strcmp(path + len - 4, ".wav") == 0) {
+        rtn = _openWav(d);
+    } else
+    if (len > 4 && strcmp(path + len - 4, ".mp3") == 0) {
+        rtn = _openMp3(d);
+    }
+
+    if (! rtn) {
+        free(d->chunk);
+        close(d->fd);
+    }
+
+    return rtn;
+
+}
+
+
+/**
+ * Close the decoder
+ * @param d decoder
+ */
+static void _closeDecoder (decoder_t *d)
+{
+
+    if (d->mh != NULL) {
+        mpg123_close(d->mh);
+        mpg123_delete(d->mh);
+    }
+    free(d->chunk);
+    close(d->fd);
+
+}
+
+
+/**
+ * Decode the next frames
+ * WAV samples are read by a chunk for the frames.
+ * @param d decoder
+ * @param out samples decoded
+ * @param count frames to decode, up to STREAM_FRAMES
+ * @return frames decoded, less than count at the end
+ */
+static long _decode (decoder_t *d, int16_t *out, long count)
+{
+
+    size_t                  size  = count * AUDIO_CHANNELS * sizeof(int16_t);
+    size_t                  got   = 0;
+    size_t                  done;
+    long                    stride;
+    long                    first;
+    long                    last;
+    ssize_t                 n;
+    int                     err;
+
+    // MP3 by libmpg123
+    if (d->mh != NULL) {
+        while (got < size) {
+            err = mpg123_read(d->mh, (unsigned char *)out + got,
+                                                        size - got, &done);
+            got += done;
+            if (err != MPG123_OK && err != MPG123_NEW_FORMAT) {
+                break;
+            }
+        }
+        count   = got / (AUDIO_CHANNELS * sizeof(int16_t));
+        d->pos += count;
+        return count;
+    }
+
+    // WAV frames needed for the frames converted
+    count = MIN(count, (long)((int64_t)d->frames * audioRate / d->rate) - d->pos);
+    if (count <= 0) {
+        return 0;
+    }
+    stride = d->channels * (d->bits / 8);
+    first  = (long)((int64_t)d->pos * d->rate / audioRate);
+    last   = (long)((int64_t)(d->pos + count - 1) * d->rate / audioRate) + 1;
+    last   = MIN(last, d->frames - 1);
+
+    n = pread(d->fd, d->chunk, (last - first + 1) * stride,
+                                                d->data + first * stride);
+    if (n < stride) {
+        return 0;
+    }
+
+    _convertWav(d, first, n / stride, out, count);
+    d->pos += count;
+
+    return count;
+
+}
+
+
+/**
+ * Move the decoder to the frame
+ * @param d decoder
+ * @param frame frame of the music
+ * @return true on success, false on failure
+ */
+static bool _seekDecoder (decoder_t *d, long frame)
+{
+
+    off_t                   pos;
+
+    if (d->mh != NULL) {
+        pos = mpg123_seek(d->mh, frame, SEEK_SET);
+        if (pos < 0) {
+            return false;
+        }
+        d->pos = pos;
+        return true;
+    }
+
+    d->pos = MIN(frame, (long)((int64_t)d->frames * audioRate / d->rate));
+
+    return true;
+
+}
+
+
+/**
+ * Decode a WAV or MP3 file into the samples
+ * @param path path to the file
+ * @param pcm samples decoded
+ * @return true on success, false on failure
+ */
+static bool _readPcm (const char *path, pcm_t *pcm)
+{
+
+    decoder_t               d;
+    int16_t *               p;
+    long                    max = 0;
+    long                    n;
+
+    if (! _openDecoder(path, &d)) {
+        return false;
+    }
+
+    pcm->samples = NULL;
+    pcm->frames  = 0;
+    do {
+        if (pcm->frames + STREAM_FRAMES > max) {
+            max = (max == 0) ? STREAM_FRAMES : max * 2;
+            p   = realloc(pcm->samples, max * AUDIO_CHANNELS * sizeof(int16_t));
+            if (p == NULL) {
+                free(pcm->samples);
+                _closeDecoder(&d);
+                return false;
+            }
+            pcm->samples = p;
+        }
+        n = _decode(&d, pcm->samples + pcm->frames * AUDIO_CHANNELS,
+                                                            STREAM_FRAMES);
+        pcm->frames += n;
+    } while (n == STREAM_FRAMES);
+
+    _closeDecoder(&d);
+
+    return true;
+
+}
+
+
+/**
+ * Finish the music and wake up its decoder
+ * Called from the audio thread.
+ */
+static void _endMusic (void)
+{
+
+    __atomic_store_n(&music.stream, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&music.done, true, __ATOMIC_SEQ_CST);
+    sem_post(&stream.wake);
+
+}
+
+
+/**
+ * Decode the music into the double buffer until it ends or is stopped
+ * Buffers of a generation before a seek are never played.
+ * @param d decoder
+ */
+static void _streamMusic (decoder_t *d)
+{
+
+    streambuf_t *           b;
+    unsigned int            gen  = 1;
+    uint64_t                seek;
+    bool                    eof  = false;
+    bool                    lost = false;
+    int                     fill = 0;
+
+    // nothing is played before the first buffer
+    while (sem_trywait(&stream.wake) == 0) {
+    }
+    stream.bufs[0].gen = 0;
+    stream.bufs[1].gen = 0;
+    stream.gen         = gen;
+    stream.cur         = 0;
+    stream.pos         = 0;
+    stream.seeked      = 0;
+    __atomic_store_n(&music.done, false, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&music.stop, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&music.stream, &stream, __ATOMIC_SEQ_CST);
+    if (! __atomic_load_n(&audioRun, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    while (! __atomic_load_n(&music.done, __ATOMIC_SEQ_CST)) {
+        // restart from the frame taken by the audio thread
+        // with its generation, a later seek cannot be taken in between
+        seek = __atomic_exchange_n(&stream.seeked, 0, __ATOMIC_ACQ_REL);
+        if (seek != 0) {
+            gen  = (unsigned int)(seek >> 32);
+            eof  = false;
+            fill = 0;
+            lost = ! _seekDecoder(d, (long)(seek & 0xffffffffu));
+        }
+
+        // fill the buffer played out
+        b = &stream.bufs[fill];
+        if (! eof && __atomic_load_n(&b->gen, __ATOMIC_ACQUIRE) != gen) {
+            b->start      = d->pos;
+            b->pcm.frames = lost ? 0 : _decode(d, b->pcm.samples, STREAM_FRAMES);
+            b->last       = b->pcm.frames < STREAM_FRAMES;
+            eof           = b->last;
+            __atomic_store_n(&b->gen, gen, __ATOMIC_RELEASE);
+            fill ^= 1;
+            continue;
+        }
+
+        sem_wait(&stream.wake);
+    }
+
+}
+
+
+/**
+ * Stop an effect voice and unpin its sound
+ * @param v voice
+ */
+static void _freeEffect (voice_t *v)
+{
+
+    __atomic_sub_fetch(&sounds[v->slot].active, 1, __ATOMIC_RELEASE);
+    v->pcm = NULL;
+
+}
+
+
+/**
+ * Take the sound triggers queued to the audio thread
+ * Each effect gets a free voice, or the oldest effect is replaced.
+ */
+static void _takeEffects (void)
+{
+
+    const soundtrigger_t *  t;
+    voice_t *               v;
+    unsigned int            head;
+    unsigned int            tail;
+    int                     i;
+
+    tail = soundring.tail;
+    head = __atomic_load_n(&soundring.head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+        t = &soundring.triggers[tail & (SOUND_QUEUE - 1)];
+
+        v = &effects[0];
+        for (i = 0; i < AUDIO_VOICES - 1; i++) {
+            if (effects[i].pcm == NULL) {
+                v = &effects[i];
+                break;
+            }
+            if (effects[i].started < v->started) {
+                v = &effects[i];
+            }
+        }
+        if (v->pcm != NULL) {
+            _freeEffect(v);
+        }
+
+        v->pcm     = &sounds[t->slot].pcm;
+        v->pos     = 0;
+        v->volume  = t->volume;
+        v->slot    = t->slot;
+        v->started = ++effecttick;
+    }
+    __atomic_store_n(&soundring.tail, tail, __ATOMIC_RELEASE);
+
+}
+
+
+/**
+ * Accumulate the samples of a voice scaled by its volume
+ * @param acc accumulator of the period
+ * @param src samples of the voice
+ * @param n number of the frames
+ * @param volume volume of the voice
+ */
+static void _mixVoice (int32_t * restrict acc, const int16_t * restrict src,
+                                                        long n, int volume)
+{
+
+    long                    i;
+
+    for (i = 0; i < n * AUDIO_CHANNELS; i++) {
+        acc[i] += src[i] * volume;
+    }
+
+}
+
+
+/**
+ * Accumulate the music from the double buffer
+ * A buffer played out is handed back to the decoder. Silence is played
+ * while the decoder is behind.
+ * @param acc accumulator of the period
+ * @param frames frames of the period
+ * @param volume volume of the music
+ * @return frame of the music at the period, -1 for silence
+ */
+static long _mixStream (int32_t *acc, long frames, int volume)
+{
+
+    streambuf_t *           b;
+    long                    start = -1;
+    long                    seek;
+    long                    n;
+
+    if (__atomic_load_n(&music.stop, __ATOMIC_ACQUIRE)) {
+        _endMusic();
+        return -1;
+    }
+
+    // drop the buffers decoded before the seek
+    seek = __atomic_exchange_n(&stream.seek, -1, __ATOMIC_ACQ_REL);
+    if (seek >= 0) {
+        stream.gen = (stream.gen == UINT_MAX) ? 1 : stream.gen + 1;
+        stream.cur = 0;
+        stream.pos = 0;
+        __atomic_store_n(&music.pos, seek, __ATOMIC_RELAXED);
+        __atomic_store_n(&stream.seeked,
+                    (uint64_t)stream.gen << 32 | (uint32_t)seek, __ATOMIC_RELEASE);
+        sem_post(&stream.wake);
+    }
+
+    while (frames > 0) {
+        b = &stream.bufs[stream.cur];
+        if (__atomic_load_n(&b->gen, __ATOMIC_ACQUIRE) != stream.gen) {
+            return start;
+        }
+        if (start < 0) {
+            start = b->start + stream.pos;
+        }
+
+        n = MIN(frames, b->pcm.frames - stream.pos);
+        _mixVoice(acc, b->pcm.samples + stream.pos * AUDIO_CHANNELS, n, volume);
+        acc        += n * AUDIO_CHANNELS;
+        frames     -= n;
+        stream.pos += n;
+        __atomic_store_n(&music.pos, b->start + stream.pos, __ATOMIC_RELAXED);
+
+        if (stream.pos == b->pcm.frames) {
+            if (b->last) {
+                _endMusic();
+                return start;
+            }
+            __atomic_store_n(&b->gen, 0, __ATOMIC_RELEASE);
+            stream.cur ^= 1;
+            stream.pos  = 0;
+            sem_post(&stream.wake);
+        }
+    }
+
+    return start;
+
+}
+
+
+/**
+ * Fill a period with the samples of the voices
+ * The voices are accumulated in 32 bit and saturated to 16 bit at once,
+ * so the cost is bounded by AUDIO_VOICES.
+ * @param buf period buffer
+ * @param frames frames of the period
+ * @return frame of the music at the period, -1 for none
+ */
+static long _mixPeriod (int16_t *buf, long frames)
+{
+
+    voice_t *               v;
+    long                    start = -1;
+    long                    n;
+    long                    i;
+    int32_t                 x;
+
+    memset(mixBuf, 0, frames * AUDIO_CHANNELS * sizeof(int32_t));
+
+    // music
+    if (__atomic_load_n(&music.stream, __ATOMIC_ACQUIRE) != NULL) {
+        start = _mixStream(mixBuf, frames,
+                        __atomic_load_n(&music.volume, __ATOMIC_RELAXED));
+    }
+
+    // effects, the slot may be replaced after the effect ends
+    _takeEffects();
+    for (i = 0; i < AUDIO_VOICES - 1; i++) {
+        v = &effects[i];
+        if (v->pcm == NULL) {
+            continue;
+        }
+        n = MIN(frames, v->pcm->frames - v->pos);
+        _mixVoice(mixBuf, v->pcm->samples + v->pos * AUDIO_CHANNELS, n,
+                                                                v->volume);
+        v->pos += n;
+        if (v->pos == v->pcm->frames) {
+            _freeEffect(v);
+        }
+    }
+
+    // saturate to the samples of the device
+    for (i = 0; i < frames * AUDIO_CHANNELS; i++) {
+        x      = mixBuf[i] >> AUDIO_VOLUME_BITS;
+        buf[i] = (int16_t)MAX(INT16_MIN, MIN(INT16_MAX, x));
+    }
+
+    return start;
+
+}
+
+
+/**
+ * Publish the frames heard from the device under the seqlock
+ * Called from the audio thread after each period is written.
+ */
+static void _updateClock (void)
+{
+
+    snd_pcm_sframes_t       delay;
+    const periodmark_t *    m;
+    uint64_t                heard;
+    long                    music;
+    int                     i;
+
+    if (snd_pcm_delay(pcmdev, &delay) < 0) {
+        return;
+    }
+    heard = written - MAX(0, MIN(delay, (snd_pcm_sframes_t)written));
+
+    // the newest period started before the frame heard
+    music = -1;
+    for (i = 1; i <= AUDIO_HISTORY; i++) {
+        m = &marks[(nextMark + AUDIO_HISTORY - i) % AUDIO_HISTORY];
+        if (m->frame <= heard) {
+            if (m->music >= 0) {
+                music = m->music + (long)MIN(heard - m->frame, periodSize);
+            }
+            break;
+        }
+    }
+
+    __atomic_store_n(&aclock.seq, aclock.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    aclock.frames  = heard;
+    aclock.written = written;
+    aclock.music   = music;
+    clock_gettime(CLOCK_MONOTONIC, &aclock.time);
+    __atomic_store_n(&aclock.seq, aclock.seq + 1, __ATOMIC_RELEASE);
+
+}
+
+
+/**
+ * Read the latest snapshot of the audio clock
+ * @param c snapshot
+ * @return true on success, false if the engine is not running
+ */
+static bool _readClock (audioclock_t *c)
+{
+
+    unsigned int            seq;
+
+    if (! __atomic_load_n(&audioRun, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    // retry while the audio thread is writing
+    do {
+        seq = __atomic_load_n(&aclock.seq, __ATOMIC_ACQUIRE);
+        *c  = aclock;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) != 0 || seq != __atomic_load_n(&aclock.seq, __ATOMIC_RELAXED));
+
+    return seq != 0;
+
+}
+
+
+/**
+ * Frames heard by now, extrapolated from the snapshot
+ * The device never plays more than written.
+ * @param c snapshot
+ * @return frames heard since the snapshot
+ */
+static double _sinceClock (const audioclock_t *c)
+{
+
+    struct timespec         now;
+    double                  elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - c->time.tv_sec) + (now.tv_nsec - c->time.tv_nsec) / 1e9;
+
+    return MAX(0.0, MIN(elapsed * audioRate, (double)(c->written - c->frames)));
+
+}
+
+
+/**
+ * Drop the sound triggers left by the stopped audio thread
+ */
+static void _dropEffects (void)
+{
+
+    int                     i;
+
+    pthread_mutex_lock(&soundLock);
+    _takeEffects();
+    for (i = 0; i < AUDIO_VOICES - 1; i++) {
+        if (effects[i].pcm != NULL) {
+            _freeEffect(&effects[i]);
+        }
+    }
+    pthread_mutex_unlock(&soundLock);
+
+}
+
+
+/**
+ * Release the sound effect in the cache slot
+ * Handles of the sound become invalid.
+ * The sounds must be locked by the caller, and the slot must not be active.
+ * @param i index of the slot
+ */
+static void _releaseSound (int i)
+{
+
+    free(sounds[i].pcm.samples);
+    free(sounds[i].path);
+    sounds[i].pcm.samples = NULL;
+    sounds[i].pcm.frames  = 0;
+    sounds[i].path        = NULL;
+
+}
+
+
+/**
+ * Thread function of the audio engine
+ * The device is kept running on silence, so playback starts at the next
+ * period.
+ * @param data dummy
+ * @return dummy
+ */
+static void * _audioThread (void *data)
+{
+
+    const int16_t *         p;
+    snd_pcm_sframes_t       n;
+    long                    left;
+
+    while (__atomic_load_n(&audioRun, __ATOMIC_ACQUIRE)) {
+        // remember where the music is in the device
+        marks[nextMark].frame = written;
+        marks[nextMark].music = _mixPeriod(periodBuf, periodSize);
+        nextMark = (nextMark + 1) % AUDIO_HISTORY;
+
+        for (p = periodBuf, left = periodSize; left > 0; ) {
+            n = snd_pcm_writei(pcmdev, p, left);
+            if (n < 0) {
+                // recover from underrun and suspend
+                n = snd_pcm_recover(pcmdev, n, 1);
+                if (n < 0) {
+                    fprintf(stderr, "Failed to write to %s: %s\n",
+                                            AUDIO_DEVICE, snd_strerror(n));
+                    __atomic_store_n(&audioRun, false, __ATOMIC_SEQ_CST);
+                    break;
+                }
+                continue;
+            }
+            p       += n * AUDIO_CHANNELS;
+            left    -= n;
+            written += n;
+        }
+        _updateClock();
+    }
+
+    // nothing is played any more
+    if (__atomic_load_n(&music.stream, __ATOMIC_SEQ_CST) != NULL) {
+        _endMusic();
+    }
+
+    return (void *)NULL;
+
+}
+
+
+/**
+ * Open the audio device with small periods
+ * @return true on success, false on failure
+ */
+static bool _openAudio (void)
+{
+
+    snd_pcm_hw_params_t *   hw   = NULL;
+    snd_pcm_sw_params_t *   sw   = NULL;
+    snd_pcm_uframes_t       size;
+    int                     err;
+
+    err = snd_pcm_open(&pcmdev, AUDIO_DEVICE, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n",
+                                            AUDIO_DEVICE, snd_strerror(err));
+        pcmdev = NULL;
+        return false;
+    }
+
+    // interleaved signed 16 bit samples
+    audioRate  = AUDIO_RATE;
+    periodSize = AUDIO_PERIOD;
+    if ((err = snd_pcm_hw_params_malloc(&hw)) < 0 ||
+        (err = snd_pcm_hw_params_any(pcmdev, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcmdev, hw,
+                                    SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcmdev, hw,
+                                    SND_PCM_FORMAT_S16_LE)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcmdev, hw,
+                                    AUDIO_CHANNELS)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(pcmdev, hw,
+                                    &audioRate, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pcmdev, hw,
+                                    &periodSize, NULL)) < 0) {
+        goto fail;
+    }
+    size = periodSize * AUDIO_PERIODS;
+    if ((err = snd_pcm_hw_params_set_buffer_size_near(pcmdev, hw,
+                                    &size)) < 0 ||
+        (err = snd_pcm_hw_params(pcmdev, hw)) < 0) {
+        goto fail;
+    }
+
+    // start on the first period and wake up on each period
+    if ((err = snd_pcm_sw_params_malloc(&sw)) < 0 ||
+        (err = snd_pcm_sw_params_current(pcmdev, sw)) < 0 ||
+        (err = snd_pcm_sw_params_set_start_threshold(pcmdev, sw,
+                                    periodSize)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(pcmdev, sw,
+                                    periodSize)) < 0 ||
+        (err = snd_pcm_sw_params(pcmdev, sw)) < 0) {
+        goto fail;
+    }
+
+    snd_pcm_hw_params_free(hw);
+    snd_pcm_sw_params_free(sw);
+
+    return true;
+
+fail:
+    fprintf(stderr, "Failed to set up %s: %s\n",
+                                            AUDIO_DEVICE, snd_strerror(err));
+    if (hw != NULL) {
+        snd_pcm_hw_params_free(hw);
+    }
+    if (sw != NULL) {
+        snd_pcm_sw_params_free(sw);
+    }
+    snd_pcm_close(pcmdev);
+    pcmdev = NULL;
+
+    return false;
+
+}
+
+
+/**
+ * Thread function to decode and play music
+ * @param data path to the music file
+ * @return dummy
+ */
+static void * _playMusic (void *data)
+{
+
+    decoder_t               d;
+
+    if (_openDecoder((char *)data, &d)) {
+        _streamMusic(&d);
+        _closeDecoder(&d);
+    } else {
+        fprintf(stderr, "Failed to read %s.\n", (char *)data);
+    }
+
+    pthread_mutex_lock(&playLock);
+    playNow = false;
+    pthread_mutex_unlock(&playLock);
+    return (void *)NULL;
+
+}
+
+
+/**
+ * Initializing function
+ * Initialize everything at once
+ * @param argc number of arguments for program invokation
+ * @param argv string array of the arguments
+ */
+void init (int *argc, char ***argv)
+{
+
+    // create DirectFB super interface
+    initialize(argc, argv);
+
+    // create primary surface
+    createPrimarySurface();
+
+    // create event buffer
+    createEventBuffer();
+
+    // initialize semaphore
+    initSemaphore();
+
+}
+
+
+/**
+ * Initializing function for offscreen mode
+ * Initialize everything at once with a primary surface on the system memory
+ * @param argc number of arguments for program invokation
+ * @param argv string array of the arguments
+ * @param w width of the primary surface
+ * @param h height of the primary surface
+ * @param format pixel format of the primary surface
+ */
+void initOffscreen (int *argc, char ***argv,
+                        int w, int h, DFBSurfacePixelFormat format)
+{
+
+    // select offscreen mode
+    setOffscreen(w, h, format);
+
+    // initialize everything
+    init(argc, argv);
+
+}
+
+
+/**
+ * Select offscreen mode
+ * The primary surface is created on the system memory instead of the
+ * display, and flip() swaps the buffers in memory without waiting for
+ * the vertical retrace. This must be called before initialize().
+ * @param w width of the primary surface, default on 0 or less
+ * @param h height of the primary surface, default on 0 or less
+ * @param format pixel format of the primary surface, default on DSPF_UNKNOWN
+ */
+void setOffscreen (int w, int h, DFBSurfacePixelFormat format)
+{
+
+    // too late if the primary surface has been created
+    if (primary != NULL) {
+        return;
+    }
+
+    offscreen = true;
+    offwidth  = (w > 0) ? w : OFFSCREEN_WIDTH;
+    offheight = (h > 0) ? h : OFFSCREEN_HEIGHT;
+    offformat = (format != DSPF_UNKNOWN) ? format : OFFSCREEN_FORMAT;
+
+}
+
+
+/**
+ * Check if running in offscreen mode
+ * @return true in offscreen mode
+ */
+bool isOffscreen (void)
+{
+
+    return offscreen;
+
+}
+
+
+/**
+ * Initializing function
+ * creates DirectFB super interface, sets the screen properties and creates
+ * primary surface.
+ * @param argc number of arguments for program invokation
+ * @param argv string array of the arguments
+ */
+void initialize (int *argc, char ***argv)
+{
+
+    bool                    system;
+
+    // create DirectFB super interface
+    if (dfb == NULL) {
+        // check if the system module is given by the user
+        system = _hasOption(*argc, *argv, "system=");
+
+        // initialize DirectFB
+        DFBCHECK(DirectFBInit(argc, argv));
+
+        // no display is needed in offscreen mode
+        if (offscreen && ! system) {
+            DFBCHECK(DirectFBSetOption("system", OFFSCREEN_SYSTEM));
+        }
+    
+        // create a super interface
+        DFBCHECK(DirectFBCreate(&dfb));
+   
+        // set fullscreen mode
+        if (! offscreen) {
+            DFBCHECK(dfb->SetCooperativeLevel(dfb, DFSCL_FULLSCREEN));
+        }
+
+        // misc initilizing tasks
+        _initialize();
+
+        // clear image slots
+        _clearImages();
+    }
+
+}
+
+
+
+/**
+ * Create a primary surface
+ *
+ */
+void createPrimarySurface (void)
+{
+
+    // check if the super interface has already been initialized
+    if (dfb == NULL) {
+        return;
+    }
+
+    // create primary surface
+    if (primary == NULL) {
+
+        // set properties of the primary surface
+        if (offscreen) {
+            // double buffered surface on the system memory
+            dsc.flags       = DSDESC_CAPS  | DSDESC_WIDTH |
+                              DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+            dsc.caps        = DSCAPS_SYSTEMONLY | DSCAPS_DOUBLE;
+            dsc.width       = offwidth;
+            dsc.height      = offheight;
+            dsc.pixelformat = offformat;
+
+            // there is no vertical retrace to wait for
+            flipflags       = DSFLIP_NONE;
+        } else {
+            dsc.flags       = DSDESC_CAPS;
+            dsc.caps        = DSCAPS_PRIMARY | DSCAPS_FLIPPING;
+            flipflags       = DSFLIP_WAITFORSYNC;
+        }
+
+        // create primary surface
+        DFBCHECK(dfb->CreateSurface(dfb, &dsc, &primary));
+
+        // check out the screen resolution
+        DFBCHECK(primary->GetSize(primary, &xres, &yres));
+
+        // nothing is known about the state of the new surface
+        _invalidateState();
+    }
+
+}
+
+
+
+/**
+ * Create an input event buffer
+ * 
+ */
+void createEventBuffer (void)
+{
+
+    // check if the super interface has already been initialized
+    if (dfb == NULL) {
+        return;
+    }
+
+    // create an button event buffer
+    if (eventbuffer == NULL) {
+        DFBCHECK(dfb->CreateInputEventBuffer(dfb, DICAPS_ALL, DFB_FALSE, &eventbuffer));
+    }
+
+}
+
+
+
+/**
+ * Initialize the semaphores to syncronize
+ *
+ */
+void initSemaphore (void)
+{
+
+    static bool             check = false;
+
+    // this should be processed just onece
+    if (check) {
+        return;
+    } else {
+        check = true;
+    }
+
+    // initialize semapohores
+    sem_init(&positiondet, 0, 0);
+
+}
+
+
+
+/**
+ * Wait for an input event
+ * @param e variable to stor input event
+ * @return true on valid event, false if not
+ */
+bool getInputEvent (DFBInputEvent *e)
+{
+
+    // check if event buffer is initialized
+    if (eventbuffer == NULL) {
+        return false;
+    }
+
+    // wait for an input event
+    eventbuffer->WaitForEvent(eventbuffer);
+
+    // retrieve the event
+    if (eventbuffer->GetEvent(eventbuffer, DFB_EVENT(e)) != DFB_OK) {
+        return false;
+    }
+
+    return true;
+
+}
+
+
+
+/**
+ * Handling button event
+ * @param e input event
+ * @return true on touch on/off event, false if not
+ */
+bool handleButton (DFBInputEvent *e)
+{
+
+    struct timespec         curtime;
+    long                    duration;
+
+    // touch on/off event
+    switch (e->type) {
+        case DIET_BUTTONPRESS:
+            clock_gettime(CLOCK_REALTIME, &lastTouch);
+            tstate = TOUCHED;
+            return true;
+        case DIET_BUTTONRELEASE:
+            clock_gettime(CLOCK_REALTIME, &curtime);
+            duration  = curtime.tv_nsec - lastTouch.tv_nsec;
+            duration += (curtime.tv_sec - lastTouch.tv_sec) * 1000000000;
+            if (ignoreItrvl > duration) {
+                // chuttering
+                break;
+            }
+            tstate = RELEASED;
+            return true;
+        default:
+            break;
+    }
+
+    return false;
+
+}
+
+
+
+/**
+ * Forget the samples of the touch position filter
+ */
+static void _resetFilter (void)
+{
+
+    samples  = 0;
+    ringhead = 0;
+    sumx     = 0;
+    sumy     = 0;
+
+}
+
+
+/**
+ * Smoothing factor of the low pass filter
+ * @param cutoff cutoff frequency in Hz
+ * @param dt sampling period in seconds
+ * @return smoothing factor
+ */
+static inline double _smoothing (double cutoff, double dt)
+{
+
+    double                  tau = 1.0 / (2.0 * M_PI * cutoff);
+
+    return 1.0 / (1.0 + tau / dt);
+
+}
+
+
+/**
+ * Put a sample into the touch position filter and update the position
+ * @param x raw X value
+ * @param y raw Y value
+ * @param t time of the sample
+ */
+static void _filterPosition (int x, int y, const struct timeval *t)
+{
+
+    double                  px;
+    double                  py;
+    double                  dt;
+    double                  a;
+
+    // new filter starts over from this sample
+    if (__atomic_load_n(&filterSet, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&filterLock);
+        tfilter = newfilter;
+        __atomic_store_n(&filterSet, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&filterLock);
+        _resetFilter();
+    }
+
+    // moving average over the ring buffer
+    if (tfilter.kind == FILTER_AVERAGE) {
+
+        // drop the oldest sample out of the window
+        if (samples == tfilter.window) {
+            sumx -= positions[ringhead].x;
+            sumy -= positions[ringhead].y;
+            samples--;
+        }
+        positions[ringhead].x = x;
+        positions[ringhead].y = y;
+        sumx    += x;
+        sumy    += y;
+        ringhead = (ringhead + 1) % tfilter.window;
+        samples++;
+
+        x = sumx / samples;
+        y = sumy / samples;
+    }
+
+    // raw value or average
+    if (tfilter.kind == FILTER_NONE || tfilter.kind == FILTER_AVERAGE) {
+        curpos.x   = (int)(((x - CalX1) * (xres - 1)) / CalXR);
+        curpos.y   = (int)(((y - CalY1) * (yres - 1)) / CalYR);
+        lastSample = *t;
+        return;
+    }
+
+    px = (double)(x - CalX1) * (xres - 1) / CalXR;
+    py = (double)(y - CalY1) * (yres - 1) / CalYR;
+
+    // first sample of a touch
+    if (samples == 0) {
+        fx      = px;
+        fy      = py;
+        fdx     = 0.0;
+        fdy     = 0.0;
+        samples = 1;
+
+    // exponential smoothing
+    } else if (tfilter.kind == FILTER_EXPONENTIAL) {
+        fx += tfilter.alpha * (px - fx);
+        fy += tfilter.alpha * (py - fy);
+
+    // 1-euro filter, smoothing less as the finger moves faster
+    } else {
+        dt  = (t->tv_sec  - lastSample.tv_sec) +
+              (t->tv_usec - lastSample.tv_usec) / 1000000.0;
+        if (dt <= 0.0) {
+            dt = FILTER_PERIOD;
+        }
+
+        a    = _smoothing(tfilter.dcutoff, dt);
+        fdx += a * ((px - fx) / dt - fdx);
+        fdy += a * ((py - fy) / dt - fdy);
+
+        fx  += _smoothing(tfilter.mincutoff + tfilter.beta * fabs(fdx), dt)
+                                                                * (px - fx);
+        fy  += _smoothing(tfilter.mincutoff + tfilter.beta * fabs(fdy), dt)
+                                                                * (py - fy);
+    }
+    lastSample = *t;
+
+    curpos.x = (int)lround(fx);
+    curpos.y = (int)lround(fy);
+
+}
+
+
+/**
+ * Handling current position
+ * A filtered position is determined on every pair of X and Y values.
+ * @param e input event
+ * @return true on axis event or false otherwise
+ */
+bool handleAxes (DFBInputEvent *e)
+{
+
+    static unsigned int     st = 0;
+    static int              x, y;
+    int                     val;
+
+    // touch off syncronization
+    if (tstate == RELEASED) {
+        _resetFilter();
+    }
+
+    // not likely but just in case
+    if (e->type != DIET_AXISMOTION) {
+        return false;
+    }
+
+    // check value
+    switch (e->axis) {
+        case DIAI_X:    // X axis
+            x   = e->axisabs;
+            st |= 1;
+            break;
+        case DIAI_Y:    // Y axis
+            y   = e->axisabs;
+            st |= 2;
+            break;
+        default:
+            return false;
+    }
+
+    // update current position
+    if (st == 3) {
+
+        // reset
+        st = 0;
+
+        _filterPosition(x, y, &e->timestamp);
+        lastReceived = _received(&e->timestamp);
+
+        // queue the position if the input thread is running
+        if (__atomic_load_n(&inputRunning, __ATOMIC_RELAXED)) {
+            _pushInput(TOUCH_MOVE, &e->timestamp);
+            return true;
+        }
+
+        // position determinating sync, once until it is taken
+        sem_getvalue(&positiondet, &val);
+        if (val == 0) {
+            sem_post(&positiondet);
+        }
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Put a touch event into the ring
+ * This is called only by the input thread.
+ * @param kind kind of the event
+ * @param t time of the event
+ * @return true on success, false if the ring is full
+ */
+static bool _pushInput (TouchEventKind kind, const struct timeval *t)
+{
+
+    touchevent_t *          ev;
+    unsigned int            head;
+    unsigned int            tail;
+    int                     val;
+
+    head = __atomic_load_n(&inputring.head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&inputring.tail, __ATOMIC_ACQUIRE);
+    if (head - tail == INPUT_RING) {
+        return false;
+    }
+
+    ev            = &inputring.events[head & (INPUT_RING - 1)];
+    ev->kind      = kind;
+    ev->pos       = curpos;
+    ev->timestamp = *t;
+    ev->received  = _received(t);
+    __atomic_store_n(&inputring.head, head + 1, __ATOMIC_RELEASE);
+
+    // wake up the render loop waiting for input
+    sem_getvalue(&positiondet, &val);
+    if (val == 0) {
+        sem_post(&positiondet);
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Thread function to read input events
+ * Touch on/off events are retried until the ring has room, positions
+ * are dropped if the render loop falls behind.
+ * @param data not used
+ */
+static void * _inputThread (void *data)
+{
+
+    DFBInputEvent           e;
+    TouchEventKind          kind;
+
+    while (__atomic_load_n(&inputRunning, __ATOMIC_ACQUIRE)) {
+
+        // woken up on stop
+        if (! getInputEvent(&e)) {
+            continue;
+        }
+
+        // touch on/off
+        if (handleButton(&e)) {
+            kind = (tstate == TOUCHED) ? TOUCH_PRESS : TOUCH_RELEASE;
+            while (! _pushInput(kind, &e.timestamp) &&
+                    __atomic_load_n(&inputRunning, __ATOMIC_RELAXED)) {
+                usleep(INPUT_RETRY);
+            }
+        }
+
+        // positions are queued by handleAxes
+        handleAxes(&e);
+    }
+
+    return NULL;
+
+}
+
+
+/**
+ * Start the input thread
+ * Input events are read in background, and the render loop takes them
+ * by pollInput() without blocking. Do not call getInputEvent() and the
+ * handlers directly while the thread is running.
+ * @return true on success, false otherwise
+ */
+bool startInputThread (void)
+{
+
+    if (eventbuffer == NULL ||
+            __atomic_load_n(&inputRunning, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    inputring.head = 0;
+    inputring.tail = 0;
+    qstate         = tstate;
+    qpos           = curpos;
+
+    __atomic_store_n(&inputRunning, true, __ATOMIC_RELEASE);
+    if (pthread_create(&inputth, NULL, _inputThread, NULL) != 0) {
+        __atomic_store_n(&inputRunning, false, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Stop the input thread
+ */
+void stopInputThread (void)
+{
+
+    if (! __atomic_load_n(&inputRunning, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_store_n(&inputRunning, false, __ATOMIC_RELEASE);
+    eventbuffer->WakeUp(eventbuffer);
+    pthread_join(inputth, NULL);
+
+    // release the render loop waiting for input
+    sem_post(&positiondet);
+
+}
+
+
+/**
+ * Take a touch event queued by the input thread
+ * This never blocks.
+ * @param e variable to store the event
+ * @return true if an event is taken, false if none is pending
+ */
+bool pollInput (touchevent_t *e)
+{
+
+    unsigned int            head;
+    unsigned int            tail;
+
+    tail = __atomic_load_n(&inputring.tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&inputring.head, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        return false;
+    }
+
+    *e = inputring.events[tail & (INPUT_RING - 1)];
+    __atomic_store_n(&inputring.tail, tail + 1, __ATOMIC_RELEASE);
+
+    // state seen by the render loop
+    switch (e->kind) {
+        case TOUCH_PRESS:
+            qstate         = TOUCHED;
+            predictSamples = 0;
+            break;
+        case TOUCH_RELEASE:
+            qstate = RELEASED;
+            break;
+        case TOUCH_MOVE:
+            qpos   = e->pos;
+            _takeInput(e->received);
+            _predict(e->pos, &e->timestamp);
+            break;
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Wait for a touch event queued by the input thread
+ * @param e variable to store the event
+ * @return true if an event is taken, false if the thread is not running
+ */
+bool waitInput (touchevent_t *e)
+{
+
+    PROF_SCOPE(waitInput);
+
+    while (! pollInput(e)) {
+        if (! __atomic_load_n(&inputRunning, __ATOMIC_ACQUIRE)) {
+            return pollInput(e);
+        }
+        sem_wait(&positiondet);
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Update the predictor on an axis
+ * @param a state of the axis
+ * @param z position measured
+ * @param dt time since the last measurement in seconds
+ */
+static void _predictAxis (predictaxis_t *a, double z, double dt)
+{
+
+    double                  p00, p01, p11;
+    double                  k0, k1;
+    double                  y;
+
+    // velocity smoothed exponentially
+    if (predictKind == PREDICT_LINEAR) {
+        a->v += PREDICT_ALPHA * ((z - a->x) / dt - a->v);
+        a->x  = z;
+        return;
+    }
+
+    // Kalman filter on constant velocity, prediction
+    a->x += a->v * dt;
+    p00   = a->p00 + dt * (2.0 * a->p01 + dt * a->p11) +
+                                    PREDICT_NOISE * dt * dt * dt * dt / 4.0;
+    p01   = a->p01 + dt * a->p11 + PREDICT_NOISE * dt * dt * dt / 2.0;
+    p11   = a->p11 + PREDICT_NOISE * dt * dt;
+
+    // correction by the measurement
+    y      = z - a->x;
+    k0     = p00 / (p00 + PREDICT_ERROR);
+    k1     = p01 / (p00 + PREDICT_ERROR);
+    a->x  += k0 * y;
+    a->v  += k1 * y;
+    a->p00 = (1.0 - k0) * p00;
+    a->p01 = (1.0 - k0) * p01;
+    a->p11 = p11 - k1 * p01;
+
+}
+
+
+/**
+ * Feed the position taken by the render loop to the predictor
+ * @param p position
+ * @param t time of the position
+ */
+static void _predict (position_t p, const struct timeval *t)
+{
+
+    double                  dt;
+
+    if (predictKind == PREDICT_NONE) {
+        return;
+    }
+
+    dt = (t->tv_sec  - predictTime.tv_sec) +
+         (t->tv_usec - predictTime.tv_usec) / 1000000.0;
+    if (dt <= 0.0) {
+        dt = FILTER_PERIOD;
+    }
+    predictTime = *t;
+
+    // first sample of a touch
+    if (predictSamples == 0) {
+        memset(&predx, 0, sizeof(predx));
+        memset(&predy, 0, sizeof(predy));
+        predx.x   = p.x;
+        predy.x   = p.y;
+        predx.p00 = predy.p00 = PREDICT_ERROR;
+        predx.p11 = predy.p11 = PREDICT_NOISE;
+        predictSamples = 1;
+        return;
+    }
+
+    _predictAxis(&predx, p.x, dt);
+    _predictAxis(&predy, p.y, dt);
+    predictSamples++;
+
+}
+
+
+/**
+ * Select the touch position predictor
+ * @param kind kind of the predictor
+ * @param lead time to extrapolate in seconds, default on 0 or less
+ */
+void setPredictor (PredictKind kind, double lead)
+{
+
+    predictKind    = kind;
+    predictLead    = (lead > 0.0) ? lead : PREDICT_LEAD;
+    predictSamples = 0;
+
+}
+
+
+/**
+ * Get the touch position predicted ahead of the last position taken
+ * The distance of the extrapolation is limited to PREDICT_MAXDIST.
+ * @return position predicted, the last position if not available
+ */
+position_t predictPosition (void)
+{
+
+    position_t              p;
+    double                  dx;
+    double                  dy;
+    double                  d;
+
+    if (predictKind == PREDICT_NONE || predictSamples < 2) {
+        return __atomic_load_n(&inputRunning, __ATOMIC_ACQUIRE) ? qpos : curpos;
+    }
+
+    dx = predx.v * predictLead;
+    dy = predy.v * predictLead;
+    d  = sqrt(dx * dx + dy * dy);
+    if (d > PREDICT_MAXDIST) {
+        dx *= PREDICT_MAXDIST / d;
+        dy *= PREDICT_MAXDIST / d;
+    }
+
+    p.x = (int)lround(predx.x + dx);
+    p.y = (int)lround(predy.x + dy);
+
+    return p;
+
+}
+
+
+/**
+ * Select the touch position filter
+ * The window of the moving average is limited to POSSAMPLES. The filter
+ * is taken by the thread handling the input at the next sample.
+ * @param f filter and its parameters
+ */
+void setTouchFilter (touchfilter_t f)
+{
+
+    f.window = MAX(1, MIN(f.window, POSSAMPLES));
+    if (f.alpha <= 0.0 || f.alpha > 1.0) {
+        f.alpha = FILTER_ALPHA;
+    }
+    if (f.mincutoff <= 0.0) {
+        f.mincutoff = FILTER_MINCUTOFF;
+    }
+    if (f.dcutoff <= 0.0) {
+        f.dcutoff = FILTER_DCUTOFF;
+    }
+
+    // handed to the thread filtering the samples
+    pthread_mutex_lock(&filterLock);
+    newfilter = f;
+    __atomic_store_n(&filterSet, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&filterLock);
+
+}
+
+
+/**
+ * Get the touch position filter
+ * @return filter and its parameters
+ */
+touchfilter_t getTouchFilter (void)
+{
+
+    touchfilter_t           f;
+
+    pthread_mutex_lock(&filterLock);
+    f = newfilter;
+    pthread_mutex_unlock(&filterLock);
+
+    return f;
+
+}
+
+
+/**
+ * Input event loop
+ * @return axis, negative value on error
+ */
+position_t eventLoop (void)
+{
+
+    DFBInputEvent           e;
+    touchevent_t            t;
+    int                     val;
+
+    PROF_SCOPE(eventLoop);
+
+    // take all the events queued by the input thread
+    if (__atomic_load_n(&inputRunning, __ATOMIC_ACQUIRE)) {
+        if (waitInput(&t)) {
+            while (pollInput(&t)) {
+                ;
+            }
+        }
+        return qpos;
+    }
+
+    while (getInputEvent(&e)) {
+
+        // handle key event
+        handleButton(&e);
+
+        // handle axis event
+        handleAxes(&e);
+
+        // break if released
+        if (tstate == RELEASED) {
+            predictSamples = 0;
+            break;
+        }
+
+        // check if axis is determined
+        sem_getvalue(&positiondet, &val);
+        if (val > 0) {
+            sem_wait(&positiondet);
+            _takeInput(lastReceived);
+            _predict(curpos, &lastSample);
+            break;
+        }
+    }
+
+    return curpos;
+
+}
+
+
+/**
+ * Return touch state
+ * @return the current touch state
+ */
+TouchState getTouchState (void)
+{
+
+    // state of the events taken from the ring
+    if (__atomic_load_n(&inputRunning, __ATOMIC_ACQUIRE)) {
+        return qstate;
+    }
+
+    return tstate;
+
+}
+
+
+/**
+ * Flip the buffer
+ * In partial flip mode only the damaged regions are copied to the front
+ * buffer, unless they cover most of the screen. In back buffer sync mode
+ * the buffers are never swapped, so the back buffer keeps the frame.
+ */
+void flip (void)
+{
+
+    if (primary == NULL) {
+        return;
+    }
+
+    _flip();
+
+    // next frame of the profiler
+    _nextProfFrame();
+
+}
+
+
+/**
+ * Flip the primary surface and measure the latency
+ */
+static void _flip (void)
+{
+
+    int                     delta;
+
+    PROF_SCOPE(flip);
+
+    // draw the deferred commands, then the ones of the contexts
+    _flushCommands();
+    _mergeContexts();
+
+    // nothing refers to the released raw images any more
+    _unmapRetired();
+
+    // input taken before is on the screen now
+    if (_presentFrame() && pendingInput != 0) {
+        // both are monotonic, a delta going backwards is dropped
+        delta = (int)(_usec() - pendingInput);
+        if (delta >= 0) {
+            _recordLatency(delta);
+        }
+        pendingInput = 0;
+    }
+
+    // periodic dump
+    if (latencyDump > 0 && time(NULL) - lastDump >= latencyDump) {
+        _dumpLatency();
+        lastDump = time(NULL);
+    }
+
+}
+
+
+/**
+ * Show the back buffer on the screen
+ * @return true if anything has been shown, false otherwise
+ */
+static bool _presentFrame (void)
+{
+
+    DFBSurfaceFlipFlags     flags;
+    long                    area = 0;
+    int                     i;
+
+    if (partialFlip || backSync) {
+
+        // nothing has been drawn, just keep the frame rate
+        if (ndamage == 0) {
+            if (! offscreen) {
+                DFBCHECK(dfb->WaitForSync(dfb));
+            }
+            return false;
+        }
+
+        // total size of the damaged regions
+        for (i = 0; i < ndamage; i++) {
+            area += _regionArea(&damage[i]);
+        }
+
+        // copy the damaged regions only
+        if (area * 100 < (long)xres * yres * DAMAGE_FULLRATIO) {
+            flags = flipflags | DSFLIP_BLIT;
+            for (i = 0; i < ndamage; i++) {
+                DFBCHECK(primary->Flip(primary, &damage[i], flags));
+                flags = DSFLIP_BLIT;
+            }
+            ndamage = 0;
+            return true;
+        }
+    }
+
+    // whole screen, copied instead of swapped to keep the back buffer
+    flags = backSync ? (flipflags | DSFLIP_BLIT) : flipflags;
+    DFBCHECK(primary->Flip(primary, NULL, flags));
+    ndamage = 0;
+
+    return true;
+
+}
+
+
+/**
+ * Time the input event was generated, on the monotonic clock
+ * The age of the event by the wall clock is taken back from now, so the
+ * time queued in the event buffer is counted. A wall clock step is
+ * limited to INPUT_AGE_MAX.
+ * @param t wall clock time of the event
+ * @return monotonic microseconds
+ */
+static unsigned int _received (const struct timeval *t)
+{
+
+    struct timeval          now;
+    int64_t                 age;
+
+    gettimeofday(&now, NULL);
+    age = (int64_t)(now.tv_sec - t->tv_sec) * 1000000 +
+                                                (now.tv_usec - t->tv_usec);
+    age = MAX(0, MIN(age, INPUT_AGE_MAX));
+
+    return _usec() - (unsigned int)age;
+
+}
+
+
+/**
+ * Monotonic time in microseconds, wrapping around
+ * @return microseconds
+ */
+static unsigned int _usec (void)
+{
+
+    struct timespec         t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (unsigned int)t.tv_sec * 1000000u + (unsigned int)(t.tv_nsec / 1000);
+
+}
+
+
+/**
+ * Bucket of the latency histogram
+ * Buckets are exact below LATENCY_SUB, and each power of 2 above is
+ * split into LATENCY_SUB buckets.
+ * @param us latency in microseconds
+ * @return index of the bucket
+ */
+static int _latencyBucket (unsigned int us)
+{
+
+    int                     shift;
+
+    if (us < LATENCY_SUB) {
+        return us;
+    }
+
+    shift = (31 - __builtin_clz(us)) - LATENCY_SUBBITS;
+
+    // the top power of 2 shares the last bucket
+    return MIN(shift * LATENCY_SUB + (int)(us >> shift), LATENCY_BUCKETS - 1);
+
+}
+
+
+/**
+ * Upper bound of the bucket of the latency histogram
+ * @param i index of the bucket
+ * @return latency in microseconds
+ */
+static unsigned int _latencyBound (int i)
+{
+
+    int                     shift;
+
+    if (i < LATENCY_SUB) {
+        return i;
+    }
+
+    shift = i / LATENCY_SUB - 1;
+
+    return (((unsigned int)(i % LATENCY_SUB + LATENCY_SUB + 1)) << shift) - 1;
+
+}
+
+
+/**
+ * Record the latency into the histogram
+ * @param us latency in microseconds
+ */
+static void _recordLatency (unsigned int us)
+{
+
+    unsigned int            max;
+
+    __atomic_fetch_add(&latencyhist[_latencyBucket(us)], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&latencymax, __ATOMIC_RELAXED);
+    while (us > max && ! __atomic_compare_exchange_n(&latencymax, &max, us,
+                            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+
+}
+
+
+/**
+ * Print the latency statistics to stderr
+ */
+static void _dumpLatency (void)
+{
+
+    latencystats_t          l = getLatency();
+
+    fprintf(stderr, "latency: %lu frames, p50 %u us, p95 %u us, "
+                    "p99 %u us, max %u us\n",
+                    l.count, l.p50, l.p95, l.p99, l.max);
+
+}
+
+
+/**
+ * Mark the input as taken by the render loop
+ * The latency is measured from the oldest input until the next flip.
+ * @param received monotonic time of the input event
+ */
+static void _takeInput (unsigned int received)
+{
+
+    if (pendingInput == 0) {
+        pendingInput = received;
+        if (pendingInput == 0) {
+            pendingInput = 1;
+        }
+    }
+
+}
+
+
+/**
+ * Current time of the profiler
+ * @return time in microseconds, wrapping around
+ */
+static unsigned int _profNow (void)
+{
+
+    return _usec();
+
+}
+
+
+/**
+ * Close the frame of the profiler and start the next one
+ */
+static void _nextProfFrame (void)
+{
+
+    profframe_t *           f;
+    unsigned int            now;
+
+    if (! profiling || profframes == NULL) {
+        return;
+    }
+
+    now    = _profNow();
+    f      = &profframes[profframe];
+    f->end = now;
+
+    profframe    = (profframe + 1) % PROF_FRAMES;
+    f            = &profframes[profframe];
+    f->start     = now;
+    f->num       = 0;
+    f->dropped   = 0;
+    profcount++;
+
+}
+
+
+/**
+ * Start a timer of the frame profiler
+ * Use PROF_SCOPE() instead, which stops the timer at the end of the scope.
+ * @param name name of the phase, must be a string literal
+ * @return timer
+ */
+profscope_t profBegin (const char *name)
+{
+
+    profscope_t             s = {name, 0, profiling && context == NULL};
+
+    if (s.on) {
+        s.start = _profNow();
+    }
+
+    return s;
+
+}
+
+
+/**
+ * Stop a timer of the frame profiler and record it into the frame
+ * Timers must be used by the thread calling flip(), threads with a drawing
+ * context are not profiled.
+ * @param s timer
+ */
+void profEnd (profscope_t *s)
+{
+
+    profframe_t *           f;
+    profrecord_t *          r;
+
+    if (! s->on || profframes == NULL) {
+        return;
+    }
+
+    f = &profframes[profframe];
+    if (f->num == PROF_RECORDS) {
+        f->dropped++;
+        return;
+    }
+
+    r           = &f->records[f->num++];
+    r->name     = s->name;
+    r->start    = s->start;
+    r->duration = _profNow() - s->start;
+
+}
+
+
+/**
+ * Enable or disable the frame profiler
+ * Records of the last PROF_FRAMES frames are kept while enabled.
+ * @param enable enable on true
+ * @return true on success, false if no memory for the records
+ */
+bool setProfiling (bool enable)
+{
+
+    if (enable && profframes == NULL) {
+        profframes = calloc(PROF_FRAMES, sizeof(profframe_t));
+        if (profframes == NULL) {
+            return false;
+        }
+    }
+
+    // start from an empty frame
+    if (enable && ! profiling) {
+        profframe               = 0;
+        profcount               = 0;
+        profframes[0].start     = _profNow();
+        profframes[0].num       = 0;
+        profframes[0].dropped   = 0;
+    }
+    profiling = enable;
+
+    return true;
+
+}
+
+
+/**
+ * Write the frames recorded in Chrome trace event format
+ * The file can be opened by chrome://tracing or Perfetto.
+ * @param path file path
+ * @return true on success, false otherwise
+ */
+bool dumpProfile (const char *path)
+{
+
+    const profframe_t *     f;
+    const profrecord_t *    r;
+    FILE *                  fp;
+    unsigned int            base;
+    int                     n;
+    int                     i;
+    int                     j;
+    bool                    ok;
+
+    if (profframes == NULL) {
+        return false;
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    // frames completed, the oldest first
+    n    = (int)MIN(profcount, (unsigned long)PROF_FRAMES - 1);
+    base = profframes[(profframe + PROF_FRAMES - n) % PROF_FRAMES].start;
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (i = 0; i < n; i++) {
+        f = &profframes[(profframe + PROF_FRAMES - n + i) % PROF_FRAMES];
+        fprintf(fp, "%s{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": 1, \"ts\": %u, \"dur\": %u, "
+                    "\"args\": {\"dropped\": %d}}",
+                    (i > 0) ? ",\n" : "",
+                    f->start - base, f->end - f->start, f->dropped);
+        for (j = 0; j < f->num; j++) {
+            r = &f->records[j];
+            fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                        "\"tid\": 1, \"ts\": %u, \"dur\": %u}",
+                        r->name, r->start - base, r->duration);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+
+    ok = ! ferror(fp);
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    return ok;
+
+}
+
+
+/**
+ * Get the touch-to-photon latency statistics
+ * The latency is measured from an input event until the flip showing
+ * the frame drawn after the position is taken by eventLoop() or
+ * pollInput(). Percentiles are rounded up to the histogram bucket,
+ * at most the maximum.
+ * @return statistics
+ */
+latencystats_t getLatency (void)
+{
+
+    latencystats_t          l = {0, 0, 0, 0, 0};
+    unsigned int            hist[LATENCY_BUCKETS];
+    unsigned long           sum = 0;
+    int                     i;
+
+    // snapshot
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        hist[i]  = __atomic_load_n(&latencyhist[i], __ATOMIC_RELAXED);
+        l.count += hist[i];
+    }
+    l.max = __atomic_load_n(&latencymax, __ATOMIC_RELAXED);
+
+    // percentiles
+    for (i = 0; i < LATENCY_BUCKETS && sum < l.count; i++) {
+        sum += hist[i];
+        if (l.p50 == 0 && sum * 100 >= l.count * 50) {
+            l.p50 = MIN(_latencyBound(i), l.max);
+        }
+        if (l.p95 == 0 && sum * 100 >= l.count * 95) {
+            l.p95 = MIN(_latencyBound(i), l.max);
+        }
+        if (l.p99 == 0 && sum * 100 >= l.count * 99) {
+            l.p99 = MIN(_latencyBound(i), l.max);
+        }
+    }
+
+    return l;
+
+}
+
+
+/**
+ * Clear the touch-to-photon latency statistics
+ */
+void resetLatency (void)
+{
+
+    int                     i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        __atomic_store_n(&latencyhist[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&latencymax, 0, __ATOMIC_RELAXED);
+
+}
+
+
+/**
+ * Dump the latency statistics to stderr periodically on flip
+ * @param seconds interval in seconds, 0 to disable
+ */
+void setLatencyDump (int seconds)
+{
+
+    latencyDump = MAX(seconds, 0);
+    lastDump    = time(NULL);
+
+}
+
+
+/**
+ * Enable or disable partial flip, disabled by default
+ * While enabled, a frame without damage is not flipped, so drawing to
+ * the primary surface directly must be reported by addDamage().
+ * @param enable copy only the damaged regions on flip() on true
+ */
+void setPartialFlip (bool enable)
+{
+
+    partialFlip = enable;
+
+}
+
+
+/**
+ * Enable or disable deferred drawing
+ * On true line(), rectangle(), triangle() and the image functions are
+ * queued and submitted in batches at flip() or submitCommands().
+ * @param enable queue the drawing commands on true
+ */
+void setDeferred (bool enable)
+{
+
+    // draw the commands queued so far
+    if (! enable && primary != NULL) {
+        _flushCommands();
+    }
+
+    deferred = enable;
+
+}
+
+
+/**
+ * Submit the deferred drawing commands now
+ */
+void submitCommands (void)
+{
+
+    if (primary == NULL) {
+        return;
+    }
+
+    _flushCommands();
+
+}
+
+
+/**
+ * Create a drawing context to record the commands of a thread
+ * @return context on success, NULL on failure
+ */
+drawctx_t * createContext (void)
+{
+
+    drawctx_t *             ctx;
+
+    // opaque black as the primary surface
+    ctx = calloc(1, sizeof(drawctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->color.a = 0xff;
+
+    return ctx;
+
+}
+
+
+/**
+ * Bind the context to the calling thread
+ * While bound, line(), polyline(), rectangle(), triangle(), setColor(),
+ * putText() and the image and sprite functions record into the context,
+ * and nothing is drawn until it is submitted. The references to the
+ * recorded surfaces are taken under the image lock, so images may be
+ * released while recorded, but released raw images stay mapped until no
+ * context holds recorded commands. The other drawing functions must be
+ * called by the thread calling flip().
+ * @param ctx context, NULL to unbind
+ */
+void bindContext (drawctx_t *ctx)
+{
+
+    context = ctx;
+
+}
+
+
+/**
+ * Hand the recorded commands over to be drawn at the next flip()
+ * Contexts are drawn after the deferred commands, in order of submission.
+ * @param ctx context
+ * @return true on success, false if the commands are kept in the context
+ */
+bool submitContext (drawctx_t *ctx)
+{
+
+    ctxbatch_t *            b;
+
+    if (ctx->buf.num == 0) {
+        return true;
+    }
+
+    b = malloc(sizeof(ctxbatch_t));
+    if (b == NULL) {
+        return false;
+    }
+
+    // the context starts over with an empty buffer
+    b->buf        = ctx->buf;
+    ctx->buf.cmds = NULL;
+    ctx->buf.num  = 0;
+    ctx->buf.max  = 0;
+
+    // push on the list taken by flip()
+    b->next = __atomic_load_n(&submitted, __ATOMIC_RELAXED);
+    while (! __atomic_compare_exchange_n(&submitted, &b->next, b, true,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // b->next is updated to the current head
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Release the context and discard the commands not submitted
+ * @param ctx context
+ */
+void releaseContext (drawctx_t *ctx)
+{
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (context == ctx) {
+        context = NULL;
+    }
+
+    _discardCommands(&ctx->buf);
+    free(ctx->buf.cmds);
+    free(ctx);
+
+}
+
+
+/**
+ * Get the statistics of the state changes of the primary surface
+ * @return numbers of the state changes issued and skipped
+ */
+statestats_t getStateStats (void)
+{
+
+    return ststats;
+
+}
+
+
+/**
+ * Reset the statistics of the state changes
+ */
+void resetStateStats (void)
+{
+
+    ststats.issued  = 0;
+    ststats.skipped = 0;
+
+}
+
+
+/**
+ * Enable or disable back buffer sync mode
+ * On true flip() copies the frame to the front buffer instead of swapping
+ * the buffers, so each primitive needs to be drawn just once.
+ * @param enable keep the back buffer same as the front buffer on true
+ */
+void setBackBufferSync (bool enable)
+{
+
+    if (enable && ! backSync && primary != NULL) {
+        // buffers may differ at this point, copy everything on next flip
+        _damageRect(0, 0, xres, yres);
+    }
+
+    backSync = enable;
+
+}
+
+
+/**
+ * Mark a region of the back buffer as damaged
+ * Use this when the back buffer is modified without the drawing functions.
+ * @param r region
+ */
+void addDamage (region_t r)
+{
+
+    if (primary == NULL) {
+        return;
+    }
+
+    _damageRect(r.x, r.y, r.w, r.h);
+
+}
+
+
+/**
+ * Clear the screen
+ */
+void clearScreen (void)
+{
+
+    color_t                 black = {0, 0, 0, 0xff};
+
+    PROF_SCOPE(clearScreen);
+
+    if (primary == NULL) {
+        return;
+    }
+
+    // draw the deferred commands first
+    _flushCommands();
+
+    _applyColor(black);
+    DFBCHECK(primary->FillRectangle(primary, 0, 0, xres, yres));
+    _damageRect(0, 0, xres, yres);
+
+}
+
+
+/**
+ * Change current color of the primary surface
+ * The color is set to DirectFB when something is drawn with it.
+ * @param c color
+ */
+void setColor (int r, int g, int b, int a)
+{
+
+    color_t                 c = {r, g, b, a};
+
+    if (primary == NULL) {
+        return;
+    }
+
+    // save current color, per thread with a context
+    if (context != NULL) {
+        context->color = c;
+    } else {
+        ccolor = c;
+    }
+
+}
+
+
+/**
+ * Fill the screen with a color
+ * @param c color
+ */
+void fillScreen (int r, int g, int b, int a)
+{
+
+    color_t                 c = {r, g, b, a};
+
+    PROF_SCOPE(fillScreen);
+
+    if (primary == NULL) {
+        return;
+    }
+
+    // draw the deferred commands first
+    _flushCommands();
+
+    _applyColor(c);
+    DFBCHECK(primary->FillRectangle(primary, 0, 0, xres, yres));
+    _damageRect(0, 0, xres, yres);
+
+}
+
+
+/**
+ * Release all the resource
+ */
+void release (void)
+{
+
+    int                     i;
+
+    // deferred commands
+    _discardCommands(&cmdbuf);
+    free(cmdbuf.cmds);
+    cmdbuf.cmds = NULL;
+    cmdbuf.max  = 0;
+
+    // commands submitted by the contexts
+    _freeBatches(__atomic_exchange_n(&submitted, NULL, __ATOMIC_ACQUIRE));
+
+    // fonts in the registry
+    for (i = 0; i < FONT_CACHE_SIZE; i++) {
+        _releaseFont(i);
+    }
+    font    = NULL;
+    curfont = FONT_NONE;
+
+    // audio engine and the sound effects
+    stopAudio();
+    for (i = 0; i < SOUND_CACHE_SIZE; i++) {
+        _releaseSound(i);
+    }
+
+    // event buffer
+    stopInputThread();
+    if (eventbuffer != NULL) {
+        eventbuffer->Release(eventbuffer);
+        eventbuffer = NULL;
+    }
+
+    // texture atlas
+    releaseSprites();
+
+    // rendered texts and message boxes
+    while (texthead != NULL) {
+        _destroyText(texthead);
+    }
+    while (boxhead != NULL) {
+        _destroyBox(boxhead);
+    }
+    _drainPools();
+
+    // frame profiler
+    profiling  = false;
+    free(profframes);
+    profframes = NULL;
+
+    // images
+    _stopLoaders();
+    for (i = 0; i < nimages; i++) {
+        releaseImage(i);
+    }
+    _clearImages();
+
+    // decoded image cache
+    while (cachehead != NULL) {
+        _destroyCache(cachehead);
+    }
+    _unmapRetired();
+
+    // primary surface
+    if (primary != NULL) {
+        primary->Release(primary);
+        primary = NULL;
+    }
+
+    // super interface
+    if (dfb != 0) {
+        dfb->Release(dfb);
+        dfb = NULL;
+    }
+
+}
+
+
+
+/**
+ * Advance the generation of a slot, invalidating its handles
+ * @param generation generation of the slot
+ * @param bits number of the index bits of the handles
+ * @return next generation, wrapping around above the index and never 0
+ */
+static unsigned int _nextGeneration (unsigned int generation, int bits)
+{
+
+    generation = (generation + 1) & ((1u << (32 - bits)) - 1);
+
+    return (generation == 0) ? 1 : generation;
+
+}
+
+
+/**
+ * Choose the slot to load into, an empty one or the least recently used
+ * @param num number of the slots
+ * @param used last use of the slot, 0 if empty, ULONG_MAX to keep it
+ * @return index of the slot, -1 if all the slots are kept
+ */
+static int _lruSlot (int num, unsigned long (*used)(int i))
+{
+
+    unsigned long           best = ULONG_MAX;
+    unsigned long           u;
+    int                     slot = -1;
+    int                     i;
+
+    for (i = 0; i < num && best != 0; i++) {
+        u = used(i);
+        if (u < best) {
+            best = u;
+            slot = i;
+        }
+    }
+
+    return slot;
+
+}
+
+
+/**
+ * Release the image in the slot
+ * The image lock must be held by the caller.
+ * @param index index of the image slot
+ */
+static void _releaseImage (int index)
+{
+
+    imageslot_t *           slot = &images[index];
+
+    if (slot->state == IMAGE_INVALID) {
+        return;
+    }
+
+    // release the surface if allocated
+    if (slot->surface != NULL) {
+        slot->surface->Release(slot->surface);
+        slot->surface = NULL;
+    }
+
+    // decoded image stays in the cache while the budget allows
+    if (slot->cache != NULL) {
+        _unrefCache(slot->cache);
+        slot->cache = NULL;
+        _trimCache();
+    }
+    _unlinkPath(index);
+
+    // invalidate the handles, never to be zero
+    slot->state      = IMAGE_INVALID;
+    slot->generation = _nextGeneration(slot->generation, IMAGE_INDEX_BITS);
+
+    // slot can be reused by loadImage()
+    if (index >= NUM_SURFACE && index < freehint) {
+        freehint = index;
+    }
+
+}
+
+
+/**
+ * Reserve the slot to load the image
+ * The image lock must be held by the caller.
+ * @param index index of the image slot
+ * @param path file path
+ */
+static void _reserveImage (int index, const char *path)
+{
+
+    _releaseImage(index);
+    images[index].state = IMAGE_LOADING;
+    _linkPath(index, path);
+
+}
+
+
+/**
+ * Find a free image slot above the ones for the index based functions
+ * The image lock must be held by the caller.
+ * @return index of the slot, -1 on failure
+ */
+static int _freeImageSlot (void)
+{
+
+    int                     i;
+
+    for (i = freehint; i < nimages; i++) {
+        if (images[i].state == IMAGE_INVALID ||
+                images[i].state == IMAGE_FAILED) {
+            break;
+        }
+    }
+    if (! _growImages(i + 1)) {
+        return -1;
+    }
+    freehint = i + 1;
+
+    return i;
+
+}
+
+
+/**
+ * Find the image being loaded or loaded from the path
+ * The image lock must be held by the caller.
+ * @param path file path
+ * @return handle of the image, IMAGE_NONE if not found
+ */
+static image_t _findImage (const char *path)
+{
+
+    int                     i;
+
+    if (images == NULL) {
+        return IMAGE_NONE;
+    }
+
+    for (i = imagehash[_hashPath(path)]; i != -1; i = images[i].next) {
+        if ((images[i].state == IMAGE_LOADING ||
+             images[i].state == IMAGE_READY) &&
+                strcmp(images[i].path, path) == 0) {
+            return IMAGE_HANDLE(i, images[i].generation);
+        }
+    }
+
+    return IMAGE_NONE;
+
+}
+
+
+/**
+ * Share the cached image with the slot unless the file has been modified
+ * The image lock must be held by the caller.
+ * @param index index of the image slot
+ * @param path file path
+ * @param mtime modification time of the file
+ * @return true if the slot got the cached image
+ */
+static bool _shareCache (int index, const char *path, time_t mtime)
+{
+
+    imageslot_t *           slot = &images[index];
+    cachedimage_t *         c;
+
+    c = _findCache(path);
+    if (c == NULL) {
+        return false;
+    }
+
+    // file has been modified
+    if (c->mtime != mtime) {
+        if (c->refs == 0) {
+            _destroyCache(c);
+        } else {
+            _unhashCache(c);
+        }
+        return false;
+    }
+
+    c->surface->AddRef(c->surface);
+    c->refs++;
+    _touchCache(c);
+    slot->surface = c->surface;
+    slot->desc    = c->desc;
+    slot->cache   = c;
+    slot->state   = IMAGE_READY;
+
+    return true;
+
+}
+
+
+/**
+ * Read the header of the raw image file
+ * @param path file path
+ * @param hdr variable to store the header
+ * @return true if the file is a raw image, false otherwise
+ */
+static bool _readRawHeader (const char *path, rawimage_t *hdr)
+{
+
+    FILE *                  fp;
+    bool                    ok;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    ok = fread(hdr, sizeof(rawimage_t), 1, fp) == 1 &&
+         memcmp(hdr->magic, RAWIMAGE_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->version == RAWIMAGE_VERSION;
+    fclose(fp);
+
+    return ok;
+
+}
+
+
+/**
+ * Map the raw image file into a surface
+ * The pixels are used in place, nothing is decoded nor copied.
+ * @param path file path
+ * @param hdr header of the file
+ * @param surface variable to store the surface
+ * @param desc variable to store the description of the surface
+ * @param map variable to store the address of the mapping
+ * @param mapsize variable to store the size of the mapping
+ * @return true on success, false otherwise
+ */
+static bool _mapImage (const char *path, const rawimage_t *hdr,
+                        IDirectFBSurface **surface, DFBSurfaceDescription *desc,
+                        void **map, size_t *mapsize)
+{
+
+    struct stat             st;
+    void *                  addr;
+    int                     fd;
+
+    // single plane of a known format, each line held by the pitch
+    if ((int)hdr->width <= 0 || (int)hdr->height <= 0 ||
+            hdr->format == DSPF_UNKNOWN ||
+            DFB_PIXELFORMAT_INDEX(hdr->format) >= DFB_NUM_PIXELFORMATS ||
+            DFB_PLANAR_PIXELFORMAT(hdr->format) ||
+            DFB_BYTES_PER_PIXEL(hdr->format) == 0 || hdr->pitch > INT_MAX ||
+            hdr->pitch < (uint64_t)hdr->width *
+                                        DFB_BYTES_PER_PIXEL(hdr->format)) {
+        return false;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // check if the file holds all the pixels, off_t may be 32 bits
+    if (fstat(fd, &st) != 0 || hdr->offset < sizeof(rawimage_t) ||
+            (uint64_t)hdr->offset + (uint64_t)hdr->pitch * hdr->height >
+                                                    (uint64_t)st.st_size) {
+        close(fd);
+        return false;
+    }
+
+    // private mapping, pages are shared with the page cache until written
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    // surface on the mapping
+    memset(desc, 0, sizeof(DFBSurfaceDescription));
+    desc->flags                    = DSDESC_WIDTH | DSDESC_HEIGHT |
+                                     DSDESC_PIXELFORMAT | DSDESC_PREALLOCATED;
+    desc->width                    = hdr->width;
+    desc->height                   = hdr->height;
+    desc->pixelformat              = hdr->format;
+    desc->preallocated[0].data     = (char *)addr + hdr->offset;
+    desc->preallocated[0].pitch    = hdr->pitch;
+    if (dfb->CreateSurface(dfb, desc, surface) != DFB_OK) {
+        munmap(addr, st.st_size);
+        return false;
+    }
+
+    *map     = addr;
+    *mapsize = st.st_size;
+
+    return true;
+
+}
+
+
+/**
+ * Write the surface into a raw image file
+ * @param s surface
+ * @param path file path
+ * @return true on success, false otherwise
+ */
+static bool _writeRawImage (IDirectFBSurface *s, const char *path)
+{
+
+    rawimage_t              hdr;
+    DFBSurfacePixelFormat   format;
+    FILE *                  fp;
+    void *                  data;
+    int                     pitch;
+    int                     w;
+    int                     h;
+    int                     y;
+    bool                    ok;
+
+    DFBCHECK(s->GetSize(s, &w, &h));
+    DFBCHECK(s->GetPixelFormat(s, &format));
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    DFBCHECK(s->Lock(s, DSLF_READ, &data, &pitch));
+
+    // header, the pixels start at the next page
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RAWIMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = RAWIMAGE_VERSION;
+    hdr.width   = w;
+    hdr.height  = h;
+    hdr.format  = format;
+    hdr.pitch   = pitch;
+    hdr.offset  = RAWIMAGE_ALIGN;
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fseek(fp, hdr.offset, SEEK_SET) == 0;
+
+    // pixels with the pitch of the surface
+    for (y = 0; ok && y < h; y++) {
+        ok = fwrite((char *)data + y * pitch, pitch, 1, fp) == 1;
+    }
+
+    DFBCHECK(s->Unlock(s));
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    if (! ok) {
+        unlink(path);
+    }
+
+    return ok;
+
+}
+
+
+/**
+ * Decode or map the image file into a new surface
+ * This does not touch the image slots, so no lock is needed.
+ * @param path file path
+ * @param surface variable to store the surface
+ * @param desc variable to store the description of the surface
+ * @param map variable to store the mapping of a raw image, NULL if decoded
+ * @param mapsize variable to store the size of the mapping
+ * @return true on success, false otherwise
+ */
+static bool _decodeImage (const char *path, IDirectFBSurface **surface,
+                                DFBSurfaceDescription *desc,
+                                void **map, size_t *mapsize)
+{
+
+    IDirectFBImageProvider *provider;
+    rawimage_t              hdr;
+    bool                    ok = false;
+
+    *map     = NULL;
+    *mapsize = 0;
+
+    // pre-converted raw image
+    if (_readRawHeader(path, &hdr)) {
+        return _mapImage(path, &hdr, surface, desc, map, mapsize);
+    }
+
+    // create image provider
+    if (dfb->CreateImageProvider(dfb, path, &provider) != DFB_OK) {
+        return false;
+    }
+
+    // obtain information of the image and create surface
+    if (provider->GetSurfaceDescription(provider, desc) == DFB_OK &&
+            dfb->CreateSurface(dfb, desc, surface) == DFB_OK) {
+
+        // render to the surface
+        ok = (provider->RenderTo(provider, *surface, NULL) == DFB_OK);
+        if (! ok) {
+            (*surface)->Release(*surface);
+        }
+    }
+
+    // release provider
+    provider->Release(provider);
+
+    return ok;
+
+}
+
+
+/**
+ * Store the decoded image into the slot reserved for it
+ * The image lock must be held by the caller.
+ * @param index index of the image slot
+ * @param generation generation of the slot when reserved
+ * @param path file path
+ * @param mtime modification time of the file
+ * @param surface decoded image, NULL if failed
+ * @param desc description of the surface
+ * @param map mapped raw image file, NULL if decoded
+ * @param mapsize size of the mapping
+ * @return true if stored, false on failure or if the slot has been reused
+ */
+static bool _storeImage (int index, unsigned int generation,
+                            const char *path, time_t mtime,
+                            IDirectFBSurface *surface,
+                            const DFBSurfaceDescription *desc,
+                            void *map, size_t mapsize)
+{
+
+    imageslot_t *           slot = &images[index];
+    cachedimage_t *         c = NULL;
+
+    // keep the decoded image
+    if (surface != NULL && slot->generation == generation &&
+                           slot->state == IMAGE_LOADING) {
+        c = _addCache(path, mtime, surface, desc, map, mapsize);
+    }
+
+    // mapping is owned by the cache, otherwise it cannot be kept
+    if (surface != NULL && c == NULL && (map != NULL ||
+            slot->generation != generation || slot->state != IMAGE_LOADING)) {
+        surface->Release(surface);
+        surface = NULL;
+        if (map != NULL) {
+            munmap(map, mapsize);
+        }
+    }
+
+    // slot has been released or reused while decoding
+    if (slot->generation != generation || slot->state != IMAGE_LOADING) {
+        return false;
+    }
+
+    // failed to decode
+    if (surface == NULL) {
+        _unlinkPath(index);
+        slot->state = IMAGE_FAILED;
+        return false;
+    }
+
+    slot->surface = surface;
+    slot->desc    = *desc;
+    slot->state   = IMAGE_READY;
+    slot->cache   = c;
+    if (c != NULL) {
+        c->refs++;
+        _trimCache();
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Load the image into the slot reserved for it
+ * The image lock must be held by the caller, and released while decoding.
+ * @param index index of the image slot
+ * @param path file path
+ * @return true on success, false otherwise
+ */
+static bool _loadImage (int index, const char *path)
+{
+
+    IDirectFBSurface *      surface = NULL;
+    DFBSurfaceDescription   desc;
+    void *                  map     = NULL;
+    size_t                  mapsize = 0;
+    unsigned int            generation = images[index].generation;
+    struct stat             st;
+    time_t                  mtime = 0;
+    bool                    ok;
+
+    pthread_mutex_unlock(&imageLock);
+    ok = (stat(path, &st) == 0);
+    pthread_mutex_lock(&imageLock);
+
+    // decoded image is in the cache
+    if (ok) {
+        mtime = st.st_mtime;
+        if (images[index].generation == generation &&
+                images[index].state == IMAGE_LOADING &&
+                _shareCache(index, path, mtime)) {
+            return true;
+        }
+    }
+
+    // decode without the lock
+    pthread_mutex_unlock(&imageLock);
+    if (ok && ! _decodeImage(path, &surface, &desc, &map, &mapsize)) {
+        surface = NULL;
+    }
+    pthread_mutex_lock(&imageLock);
+
+    return _storeImage(index, generation, path, mtime, surface, &desc,
+                                                            map, mapsize);
+
+}
+
+
+/**
+ * Check if a job is to be done before another
+ * @return true if a is prior to b
+ */
+static inline bool _jobBefore (const imagejob_t *a, const imagejob_t *b)
+{
+
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+
+    return a->seq < b->seq;
+
+}
+
+
+/**
+ * Push a job into the priority queue
+ * The image lock must be held by the caller.
+ * @param job job to push
+ * @return true on success, false otherwise
+ */
+static bool _pushJob (imagejob_t job)
+{
+
+    imagejob_t *            heap;
+    imagejob_t              t;
+    int                     max;
+    int                     i;
+
+    // grow the heap
+    if (njobs == maxjobs) {
+        max  = (maxjobs == 0) ? NUM_SURFACE : maxjobs * 2;
+        heap = realloc(jobs, max * sizeof(imagejob_t));
+        if (heap == NULL) {
+            return false;
+        }
+        jobs    = heap;
+        maxjobs = max;
+    }
+
+    // sift up
+    job.seq     = jobseq++;
+    i           = njobs++;
+    jobs[i]     = job;
+    while (i > 0 && _jobBefore(&jobs[i], &jobs[(i - 1) / 2])) {
+        t                   = jobs[i];
+        jobs[i]             = jobs[(i - 1) / 2];
+        jobs[(i - 1) / 2]   = t;
+        i                   = (i - 1) / 2;
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Pop the job of the highest priority
+ * The image lock must be held by the caller, and the queue not be empty.
+ * @return job
+ */
+static imagejob_t _popJob (void)
+{
+
+    imagejob_t              job = jobs[0];
+    imagejob_t              t;
+    int                     i = 0;
+    int                     c;
+
+    // sift down
+    jobs[0] = jobs[--njobs];
+    while ((c = 2 * i + 1) < njobs) {
+        if (c + 1 < njobs && _jobBefore(&jobs[c + 1], &jobs[c])) {
+            c++;
+        }
+        if (! _jobBefore(&jobs[c], &jobs[i])) {
+            break;
+        }
+        t       = jobs[i];
+        jobs[i] = jobs[c];
+        jobs[c] = t;
+        i       = c;
+    }
+
+    return job;
+
+}
+
+
+/**
+ * Thread function to load images in background
+ * @param data dummy
+ * @return dummy
+ */
+static void * _loaderThread (void *data)
+{
+
+    imagejob_t              job;
+
+    pthread_mutex_lock(&imageLock);
+    while (true) {
+
+        // wait for a job
+        while (loading && njobs == 0) {
+            pthread_cond_wait(&jobCond, &imageLock);
+        }
+        if (! loading) {
+            break;
+        }
+        job = _popJob();
+
+        // skip if the slot has been released or reused while queued
+        if (images[job.index].generation == job.generation &&
+                images[job.index].state == IMAGE_LOADING) {
+            _loadImage(job.index, job.path);
+            pthread_cond_broadcast(&imageCond);
+        }
+        free(job.path);
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return (void *)NULL;
+
+}
+
+
+/**
+ * Start the threads to load images unless started
+ * The image lock must be held by the caller.
+ * @return true on success, false otherwise
+ */
+static bool _startLoaders (void)
+{
+
+    if (nloaders > 0) {
+        return true;
+    }
+
+    loading = true;
+    while (nloaders < LOADER_THREADS) {
+        if (pthread_create(&loaders[nloaders], NULL,
+                                _loaderThread, NULL) != 0) {
+            fprintf(stderr, "Failed to start the thread to load images.\n");
+            break;
+        }
+        nloaders++;
+    }
+
+    return nloaders > 0;
+
+}
+
+
+/**
+ * Stop the threads to load images and drop the queued jobs
+ */
+static void _stopLoaders (void)
+{
+
+    int                     i;
+
+    pthread_mutex_lock(&imageLock);
+    loading = false;
+    pthread_cond_broadcast(&jobCond);
+    pthread_mutex_unlock(&imageLock);
+
+    for (i = 0; i < nloaders; i++) {
+        pthread_join(loaders[i], NULL);
+    }
+    nloaders = 0;
+
+    while (njobs > 0) {
+        free(_popJob().path);
+    }
+    free(jobs);
+    jobs    = NULL;
+    maxjobs = 0;
+
+}
+
+
+/**
+ * Queue the job to load the image into the slot reserved for it
+ * The image lock must be held by the caller.
+ * @param index index of the image slot
+ * @param path file path
+ * @param priority priority, higher is loaded earlier
+ * @return handle of the image, IMAGE_NONE on failure
+ */
+static image_t _queueImage (int index, const char *path, int priority)
+{
+
+    imagejob_t              job;
+
+    if (! _startLoaders()) {
+        return IMAGE_NONE;
+    }
+
+    _reserveImage(index, path);
+    job.path       = strdup(path);
+    job.index      = index;
+    job.generation = images[index].generation;
+    job.priority   = priority;
+    if (job.path == NULL || ! _pushJob(job)) {
+        free(job.path);
+        _releaseImage(index);
+        return IMAGE_NONE;
+    }
+    pthread_cond_signal(&jobCond);
+
+    return IMAGE_HANDLE(index, job.generation);
+
+}
+
+
+/**
+ * Release the image
+ * Handles of the image become invalid.
+ * @param index index of the image slot
+ */
+void releaseImage (int index)
+{
+
+    // check if index is valid
+    if (! _checkIndex(index)) {
+        return;
+    }
+
+    pthread_mutex_lock(&imageLock);
+    if (index < nimages) {
+        _releaseImage(index);
+    }
+    pthread_mutex_unlock(&imageLock);
+
+}
+
+
+/**
+ * Read the image
+ * The image decoded before is shared unless the file has been modified.
+ * @param index index of the image slot
+ * @param path file path
+ * @return true on success, false otherwise
+ */
+bool readImage (int index, const char *path)
+{
+
+    bool                    ok = false;
+
+    // check primary surface and index
+    if (! _checkIndex(index)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&imageLock);
+    if (_growImages(index + 1)) {
+        _reserveImage(index, path);
+        ok = _loadImage(index, path);
+        pthread_cond_broadcast(&imageCond);
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return ok;
+
+}
+
+
+/**
+ * Read the image in background
+ * This returns immediately, use imageStatus() or waitImage() to check
+ * if the image is available.
+ * @param index index of the image slot
+ * @param path file path
+ * @param priority priority, higher is loaded earlier
+ * @return handle of the image, IMAGE_NONE on failure
+ */
+image_t readImageAsync (int index, const char *path, int priority)
+{
+
+    image_t                 image = IMAGE_NONE;
+
+    // check primary surface and index
+    if (! _checkIndex(index)) {
+        return IMAGE_NONE;
+    }
+
+    pthread_mutex_lock(&imageLock);
+    if (_growImages(index + 1)) {
+        image = _queueImage(index, path, priority);
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return image;
+
+}
+
+
+/**
+ * Convert the image file into the raw image format
+ * readImage() maps a raw image file into memory without decoding.
+ * The pixels are stored in the native byte order.
+ * @param src path of the image file
+ * @param dst path of the raw image file
+ * @param format pixel format, on DSPF_UNKNOWN the format of the image is
+ *               kept if it has alpha channel, otherwise the format of the
+ *               primary surface is used
+ * @return true on success, false otherwise
+ */
+bool convertRawImage (const char *src, const char *dst,
+                        DFBSurfacePixelFormat format)
+{
+
+    IDirectFBImageProvider *provider;
+    IDirectFBSurface *      s;
+    DFBSurfaceDescription   d;
+    bool                    ok = false;
+
+    if (primary == NULL) {
+        return false;
+    }
+
+    // create image provider
+    if (dfb->CreateImageProvider(dfb, src, &provider) != DFB_OK) {
+        return false;
+    }
+
+    if (provider->GetSurfaceDescription(provider, &d) == DFB_OK) {
+
+        // select the pixel format
+        if (format == DSPF_UNKNOWN) {
+            if ((d.flags & DSDESC_PIXELFORMAT) &&
+                    DFB_PIXELFORMAT_HAS_ALPHA(d.pixelformat)) {
+                format = d.pixelformat;
+            } else {
+                DFBCHECK(primary->GetPixelFormat(primary, &format));
+            }
+        }
+        d.flags       |= DSDESC_PIXELFORMAT;
+        d.pixelformat  = format;
+
+        // render and write out
+        if (dfb->CreateSurface(dfb, &d, &s) == DFB_OK) {
+            ok = provider->RenderTo(provider, s, NULL) == DFB_OK &&
+                 _writeRawImage(s, dst);
+            s->Release(s);
+        }
+    }
+
+    provider->Release(provider);
+
+    return ok;
+
+}
+
+
+/**
+ * Pin or unpin the decoded image of the path
+ * Pinned images are never evicted from the cache.
+ * @param path file path
+ * @param pin pin on true, unpin on false
+ * @return true on success, false if the image is not cached
+ */
+bool pinImage (const char *path, bool pin)
+{
+
+    cachedimage_t *         c;
+
+    pthread_mutex_lock(&imageLock);
+    c = _findCache(path);
+    if (c != NULL) {
+        c->pinned = pin;
+        if (! pin) {
+            _trimCache();
+        }
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return c != NULL;
+
+}
+
+
+/**
+ * Set the memory budget of the decoded image cache
+ * @param bytes budget in bytes
+ */
+void setImageCacheBudget (size_t bytes)
+{
+
+    pthread_mutex_lock(&imageLock);
+    cachebudget = bytes;
+    _trimCache();
+    pthread_mutex_unlock(&imageLock);
+
+}
+
+
+/**
+ * Get the memory used by the decoded image cache
+ * Images in use and pinned are counted as well.
+ * @return size in bytes
+ */
+size_t getImageCacheSize (void)
+{
+
+    size_t                  bytes;
+
+    pthread_mutex_lock(&imageLock);
+    bytes = cachebytes;
+    pthread_mutex_unlock(&imageLock);
+
+    return bytes;
+
+}
+
+
+/**
+ * Find the image loaded from the path
+ * @param path file path
+ * @return handle of the image, IMAGE_NONE if not loaded
+ */
+image_t findImage (const char *path)
+{
+
+    image_t                 image;
+
+    pthread_mutex_lock(&imageLock);
+    image = _findImage(path);
+    pthread_mutex_unlock(&imageLock);
+
+    return image;
+
+}
+
+
+/**
+ * Load the image unless already loaded
+ * A free slot is allocated above the ones for the index based functions.
+ * @param path file path
+ * @return handle of the image, IMAGE_NONE on failure
+ */
+image_t loadImage (const char *path)
+{
+
+    image_t                 image;
+    int                     i;
+
+    if (primary == NULL) {
+        return IMAGE_NONE;
+    }
+
+    pthread_mutex_lock(&imageLock);
+
+    // already loaded or being loaded
+    image = _findImage(path);
+    if (image != IMAGE_NONE) {
+        pthread_mutex_unlock(&imageLock);
+        return waitImage(image) ? image : IMAGE_NONE;
+    }
+
+    // load into a free slot
+    i = _freeImageSlot();
+    if (i >= 0) {
+        _reserveImage(i, path);
+        if (_loadImage(i, path)) {
+            image = IMAGE_HANDLE(i, images[i].generation);
+        }
+        pthread_cond_broadcast(&imageCond);
+    }
+
+    pthread_mutex_unlock(&imageLock);
+
+    return image;
+
+}
+
+
+/**
+ * Load the image in background unless already loaded
+ * This returns immediately, use imageStatus() or waitImage() to check
+ * if the image is available.
+ * @param path file path
+ * @param priority priority, higher is loaded earlier
+ * @return handle of the image, IMAGE_NONE on failure
+ */
+image_t loadImageAsync (const char *path, int priority)
+{
+
+    image_t                 image;
+    int                     i;
+
+    if (primary == NULL) {
+        return IMAGE_NONE;
+    }
+
+    pthread_mutex_lock(&imageLock);
+
+    // already loaded or being loaded
+    image = _findImage(path);
+    if (image == IMAGE_NONE) {
+        i = _freeImageSlot();
+        if (i >= 0) {
+            image = _queueImage(i, path, priority);
+        }
+    }
+
+    pthread_mutex_unlock(&imageLock);
+
+    return image;
+
+}
+
+
+/**
+ * Get the status of the image
+ * @param image handle of the image
+ * @return IMAGE_LOADING, IMAGE_READY, IMAGE_FAILED or
+ *         IMAGE_INVALID if the handle is no longer valid
+ */
+ImageStatus imageStatus (image_t image)
+{
+
+    int                     index = IMAGE_INDEX(image);
+    ImageStatus             status = IMAGE_INVALID;
+
+    pthread_mutex_lock(&imageLock);
+    if (index < nimages && images[index].generation == IMAGE_GENERATION(image)) {
+        status = images[index].state;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return status;
+
+}
+
+
+/**
+ * Wait until the image has been loaded
+ * @param image handle of the image
+ * @return true if the image is available, false otherwise
+ */
+bool waitImage (image_t image)
+{
+
+    int                     index = IMAGE_INDEX(image);
+    ImageStatus             status = IMAGE_INVALID;
+
+    pthread_mutex_lock(&imageLock);
+    while (index < nimages &&
+            images[index].generation == IMAGE_GENERATION(image)) {
+        status = images[index].state;
+        if (status != IMAGE_LOADING) {
+            break;
+        }
+        pthread_cond_wait(&imageCond, &imageLock);
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return status == IMAGE_READY;
+
+}
+
+
+/**
+ * Get the slot index of the image
+ * @param image handle of the image
+ * @return index of the image slot, -1 if the image is not available
+ */
+int imageIndex (image_t image)
+{
+
+    int                     index = IMAGE_INDEX(image);
+
+    pthread_mutex_lock(&imageLock);
+    if (index >= nimages || images[index].state != IMAGE_READY ||
+            images[index].generation != IMAGE_GENERATION(image)) {
+        index = -1;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return index;
+
+}
+
+
+
+/**
+ * Render the image at top left coner
+ * @param index index of the image slot
+ * @param alpha enable alpha blending on true
+ */
+void renderImage (int index, bool alpha)
+{
+
+    position_t              p = {0, 0};
+
+    PROF_SCOPE(renderImage);
+
+    // check if primary surface is available
+    if (! _checkSurface(index)) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if (deferred || context != NULL) {
+        putImage(index, p, alpha);
+        return;
+    }
+
+    // set setting of blending
+    _applyBlittingFlags(alpha ? DSBLIT_BLEND_ALPHACHANNEL : DSBLIT_NOFX);
+
+    DFBCHECK(primary->Blit(primary, images[index].surface, NULL, 0, 0));
+    _damageRect(0, 0, images[index].desc.width, images[index].desc.height);
+
+}
+
+
+
+/**
+ * Render the image at the position
+ * @param index index of the image slot
+ * @param p position to render the image 
+ * @param alpha enable alpha blending on true
+ */
+void putImage (int index, position_t p, bool alpha)
+{
+
+    command_t *             c;
+    int                     w;
+    int                     h;
+
+    PROF_SCOPE(putImage);
+
+    // check if primary surface is available
+    if (! _checkSurface(index)) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_BLIT)) != NULL) {
+        // slot may be grown, released or reloaded by another thread
+        pthread_mutex_lock(&imageLock);
+        if (index >= nimages || images[index].state != IMAGE_READY) {
+            pthread_mutex_unlock(&imageLock);
+            _unrecord();
+            return;
+        }
+        w                = images[index].desc.width;
+        h                = images[index].desc.height;
+        c->alpha         = alpha;
+        _holdSource(c, images[index].surface);
+        pthread_mutex_unlock(&imageLock);
+        c->g.blit.from.x = 0;
+        c->g.blit.from.y = 0;
+        c->g.blit.from.w = w;
+        c->g.blit.from.h = h;
+        c->g.blit.to.x   = p.x;
+        c->g.blit.to.y   = p.y;
+        c->g.blit.to.w   = w;
+        c->g.blit.to.h   = h;
+        _queued(c, p.x, p.y, p.x + w - 1, p.y + h - 1);
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    // set setting of blending
+    _applyBlittingFlags(alpha ? DSBLIT_BLEND_ALPHACHANNEL : DSBLIT_NOFX);
+
+    DFBCHECK(primary->Blit(primary, images[index].surface, NULL, p.x, p.y));
+    _damageRect(p.x, p.y, images[index].desc.width, images[index].desc.height);
+
+}
+
+
+/**
+ * Render the image with regions
+ * @param index index of the image slot
+ * @param from region of the source image
+ * @param to region of the destination surface
+ * @param alpha enable alpha blending on true
+ */
+void stretchImage (int index, region_t from, region_t to, bool alpha)
+{
+
+    command_t *             c;
+
+    PROF_SCOPE(stretchImage);
+
+    // check if primary surface is available
+    if (! _checkSurface(index)) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_STRETCH)) != NULL) {
+        // slot may be grown, released or reloaded by another thread
+        pthread_mutex_lock(&imageLock);
+        if (index >= nimages || images[index].state != IMAGE_READY) {
+            pthread_mutex_unlock(&imageLock);
+            _unrecord();
+            return;
+        }
+        c->alpha       = alpha;
+        _holdSource(c, images[index].surface);
+        pthread_mutex_unlock(&imageLock);
+        c->g.blit.from = from;
+        c->g.blit.to   = to;
+        _queued(c, to.x, to.y, to.x + to.w - 1, to.y + to.h - 1);
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    // set setting of blending
+    _applyBlittingFlags(alpha ? DSBLIT_BLEND_ALPHACHANNEL : DSBLIT_NOFX);
+
+    DFBCHECK(primary->StretchBlit(primary, images[index].surface, &from, &to));
+    _damageRect(to.x, to.y, to.w, to.h);
+
+}
+
+
+/**
+ * Check if the sprite is available
+ * @param s handle of the sprite
+ * @return true if available, false otherwise
+ */
+static bool _checkSprite (sprite_t s)
+{
+
+    return primary != NULL && s != SPRITE_NONE && s <= nsprites;
+
+}
+
+
+/**
+ * Get the size of the image file without decoding it
+ * @param path file path
+ * @param w variable to store the width
+ * @param h variable to store the height
+ * @return true on success, false otherwise
+ */
+static bool _imageSize (const char *path, int *w, int *h)
+{
+
+    IDirectFBImageProvider *provider;
+    DFBSurfaceDescription   desc;
+    rawimage_t              hdr;
+    bool                    ok;
+
+    // pre-converted raw image
+    if (_readRawHeader(path, &hdr)) {
+        *w = hdr.width;
+        *h = hdr.height;
+        return true;
+    }
+
+    if (dfb->CreateImageProvider(dfb, path, &provider) != DFB_OK) {
+        return false;
+    }
+    ok = provider->GetSurfaceDescription(provider, &desc) == DFB_OK;
+    provider->Release(provider);
+
+    *w = desc.width;
+    *h = desc.height;
+
+    return ok;
+
+}
+
+
+/**
+ * Add a new page to the atlas
+ * @return index of the page, -1 on failure
+ */
+static int _newPage (void)
+{
+
+    DFBSurfaceDescription   desc;
+    atlaspage_t *           p;
+
+    pthread_mutex_lock(&imageLock);
+    p = realloc(pages, (npages + 1) * sizeof(atlaspage_t));
+    if (p != NULL) {
+        pages = p;
+    }
+    pthread_mutex_unlock(&imageLock);
+    if (p == NULL) {
+        return -1;
+    }
+
+    // page with alpha channel for sprites of any kind
+    desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+    desc.width       = ATLAS_WIDTH;
+    desc.height      = ATLAS_HEIGHT;
+    desc.pixelformat = DSPF_ARGB;
+
+    p = &pages[npages];
+    if (dfb->CreateSurface(dfb, &desc, &p->surface) != DFB_OK) {
+        return -1;
+    }
+    DFBCHECK(p->surface->Clear(p->surface, 0, 0, 0, 0));
+    DFBCHECK(p->surface->SetBlittingFlags(p->surface, DSBLIT_NOFX));
+
+    p->shelves    = NULL;
+    p->nshelves   = 0;
+    p->maxshelves = 0;
+    p->top        = 0;
+
+    return npages++;
+
+}
+
+
+/**
+ * Open a new shelf at the bottom of the page
+ * @param p page
+ * @param h height of the shelf
+ * @return new shelf, NULL if the page is full
+ */
+static shelf_t * _newShelf (atlaspage_t *p, int h)
+{
+
+    shelf_t *               shelves;
+    int                     max;
+
+    if (p->top + h > ATLAS_HEIGHT) {
+        return NULL;
+    }
+
+    // grow the shelves
+    if (p->nshelves == p->maxshelves) {
+        max     = (p->maxshelves == 0) ? 8 : p->maxshelves * 2;
+        shelves = realloc(p->shelves, max * sizeof(shelf_t));
+        if (shelves == NULL) {
+            return NULL;
+        }
+        p->shelves    = shelves;
+        p->maxshelves = max;
+    }
+
+    p->shelves[p->nshelves].x = 0;
+    p->shelves[p->nshelves].y = p->top;
+    p->shelves[p->nshelves].h = h;
+    p->top += h;
+
+    return &p->shelves[p->nshelves++];
+
+}
+
+
+/**
+ * Find room for a sprite in the atlas
+ * The lowest shelf the sprite fits in is used, a new shelf is opened
+ * at the bottom of a page otherwise, and a new page at last.
+ * @param w width of the sprite
+ * @param h height of the sprite
+ * @param page variable to store the index of the page
+ * @param r variable to store the rectangle in the page
+ * @return true on success, false otherwise
+ */
+static bool _packSprite (int w, int h, int *page, DFBRectangle *r)
+{
+
+    shelf_t *               best;
+    shelf_t *               sh;
+    int                     pw = w + ATLAS_PADDING;
+    int                     ph = h + ATLAS_PADDING;
+    int                     i;
+    int                     j;
+
+    if (w <= 0 || h <= 0 || pw > ATLAS_WIDTH || ph > ATLAS_HEIGHT) {
+        return false;
+    }
+
+    best = NULL;
+    for (i = 0; i < npages && best == NULL; i++) {
+
+        // shelf wasting the least height
+        for (j = 0; j < pages[i].nshelves; j++) {
+            sh = &pages[i].shelves[j];
+            if (sh->h >= ph && sh->x + pw <= ATLAS_WIDTH &&
+                    (best == NULL || sh->h < best->h)) {
+                best = sh;
+            }
+        }
+
+        // no shelf is tall enough
+        if (best == NULL) {
+            best = _newShelf(&pages[i], ph);
+        }
+        *page = i;
+    }
+
+    // all pages are full
+    if (best == NULL) {
+        *page = _newPage();
+        if (*page < 0 || (best = _newShelf(&pages[*page], ph)) == NULL) {
+            return false;
+        }
+    }
+
+    r->x     = best->x;
+    r->y     = best->y;
+    r->w     = w;
+    r->h     = h;
+    best->x += pw;
+
+    return true;
+
+}
+
+
+/**
+ * Render the image file into the atlas
+ * @param path file path
+ * @param page index of the page
+ * @param r rectangle in the page
+ * @return true on success, false otherwise
+ */
+static bool _renderSprite (const char *path, int page, const DFBRectangle *r)
+{
+
+    IDirectFBSurface *      dst = pages[page].surface;
+    IDirectFBImageProvider *provider;
+    IDirectFBSurface *      src;
+    DFBSurfaceDescription   desc;
+    rawimage_t              hdr;
+    void *                  map;
+    size_t                  mapsize;
+    bool                    ok;
+
+    // copy the pixels of the raw image
+    if (_readRawHeader(path, &hdr)) {
+        if (! _mapImage(path, &hdr, &src, &desc, &map, &mapsize)) {
+            return false;
+        }
+        DFBCHECK(dst->Blit(dst, src, NULL, r->x, r->y));
+        src->Release(src);
+        DFBCHECK(dfb->WaitIdle(dfb));
+        munmap(map, mapsize);
+        return true;
+    }
+
+    // decode into the page directly
+    if (dfb->CreateImageProvider(dfb, path, &provider) != DFB_OK) {
+        return false;
+    }
+    ok = provider->RenderTo(provider, dst, r) == DFB_OK;
+    provider->Release(provider);
+
+    return ok;
+
+}
+
+
+/**
+ * Grow the sprite table
+ * @return true on success, false otherwise
+ */
+static bool _growSprites (int num)
+{
+
+    spriteslot_t *          s;
+    int                     max;
+
+    if (num <= maxsprites) {
+        return true;
+    }
+
+    max = (maxsprites == 0) ? 64 : maxsprites * 2;
+    while (max < num) {
+        max *= 2;
+    }
+
+    pthread_mutex_lock(&imageLock);
+    s = realloc(sprites, max * sizeof(spriteslot_t));
+    if (s != NULL) {
+        sprites    = s;
+        maxsprites = max;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return s != NULL;
+
+}
+
+
+/**
+ * Compare sprites to pack the taller one first
+ */
+static int _tallerFirst (const void *a, const void *b)
+{
+
+    return ((const spriteslot_t *)b)->rect.h - ((const spriteslot_t *)a)->rect.h;
+
+}
+
+
+/**
+ * Pack the image files into the texture atlas
+ * The images are sorted by height before packing, so adding many images
+ * at once packs them tighter than adding them one by one.
+ * @param paths file paths
+ * @param num number of the files
+ * @param handles array to store the handles of the sprites,
+ *                SPRITE_NONE for the images failed
+ * @return number of the images packed
+ */
+int addSprites (const char **paths, int num, sprite_t *handles)
+{
+
+    spriteslot_t *          order;
+    spriteslot_t *          s;
+    int                     packed = 0;
+    int                     i;
+    int                     k;
+
+    if (primary == NULL || num <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < num; i++) {
+        handles[i] = SPRITE_NONE;
+    }
+
+    // sizes of the images, the page holds the index into paths
+    order = malloc(num * sizeof(spriteslot_t));
+    if (order == NULL || ! _growSprites(nsprites + num)) {
+        free(order);
+        return 0;
+    }
+    for (i = 0, k = 0; i < num; i++) {
+        if (_imageSize(paths[i], &order[k].rect.w, &order[k].rect.h)) {
+            order[k++].page = i;
+        }
+    }
+    qsort(order, k, sizeof(spriteslot_t), _tallerFirst);
+
+    // pack and render
+    for (i = 0; i < k; i++) {
+        s = &sprites[nsprites];
+        if (! _packSprite(order[i].rect.w, order[i].rect.h,
+                                                &s->page, &s->rect) ||
+                ! _renderSprite(paths[order[i].page], s->page, &s->rect)) {
+            continue;
+        }
+        pthread_mutex_lock(&imageLock);
+        handles[order[i].page] = ++nsprites;
+        pthread_mutex_unlock(&imageLock);
+        packed++;
+    }
+
+    free(order);
+
+    return packed;
+
+}
+
+
+/**
+ * Pack the image file into the texture atlas
+ * @param path file path
+ * @return handle of the sprite, SPRITE_NONE on failure
+ */
+sprite_t addSprite (const char *path)
+{
+
+    sprite_t                s = SPRITE_NONE;
+
+    addSprites(&path, 1, &s);
+
+    return s;
+
+}
+
+
+/**
+ * Release the texture atlas
+ * Handles of all the sprites become invalid.
+ */
+void releaseSprites (void)
+{
+
+    int                     i;
+
+    pthread_mutex_lock(&imageLock);
+    for (i = 0; i < npages; i++) {
+        pages[i].surface->Release(pages[i].surface);
+        free(pages[i].shelves);
+    }
+    free(pages);
+    free(sprites);
+
+    pages      = NULL;
+    npages     = 0;
+    sprites    = NULL;
+    nsprites   = 0;
+    maxsprites = 0;
+    pthread_mutex_unlock(&imageLock);
+
+}
+
+
+/**
+ * Get the size of the sprite
+ * @param s handle of the sprite
+ * @return size of the sprite, {-1, -1} if not available
+ */
+scsize_t getSpriteSize (sprite_t s)
+{
+
+    scsize_t                size = {-1, -1};
+
+    pthread_mutex_lock(&imageLock);
+    if (_checkSprite(s)) {
+        size.w = sprites[s - 1].rect.w;
+        size.h = sprites[s - 1].rect.h;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    return size;
+
+}
+
+
+/**
+ * Render the sprite at the position
+ * @param s handle of the sprite
+ * @param p position to render the sprite
+ * @param alpha enable alpha blending on true
+ */
+void putSprite (sprite_t s, position_t p, bool alpha)
+{
+
+    putSprites(&s, &p, 1, alpha);
+
+}
+
+
+/**
+ * Render the sprites at the positions
+ * Sprites on the same page are drawn by a batched blit.
+ * @param s handles of the sprites
+ * @param p positions to render the sprites
+ * @param num number of the sprites
+ * @param alpha enable alpha blending on true
+ */
+void putSprites (const sprite_t *s, const position_t *p, int num, bool alpha)
+{
+
+    const spriteslot_t *    sp;
+    command_t *             c;
+    int                     page = -1;
+    int                     n    = 0;
+    int                     i;
+
+    PROF_SCOPE(putSprites);
+
+    for (i = 0; i < num; i++) {
+
+        // record or queue in deferred mode, batched at submission
+        if ((c = _record(CMD_BLIT)) != NULL) {
+            // tables may be grown by addSprites() while contexts record
+            pthread_mutex_lock(&imageLock);
+            if (! _checkSprite(s[i])) {
+                pthread_mutex_unlock(&imageLock);
+                _unrecord();
+                continue;
+            }
+            sp               = &sprites[s[i] - 1];
+            c->alpha         = alpha;
+            _holdSource(c, pages[sp->page].surface);
+            c->g.blit.from   = sp->rect;
+            pthread_mutex_unlock(&imageLock);
+            c->g.blit.to.x   = p[i].x;
+            c->g.blit.to.y   = p[i].y;
+            c->g.blit.to.w   = c->g.blit.from.w;
+            c->g.blit.to.h   = c->g.blit.from.h;
+            _queued(c, p[i].x, p[i].y, p[i].x + c->g.blit.to.w - 1,
+                                       p[i].y + c->g.blit.to.h - 1);
+            continue;
+        }
+        if (context != NULL || ! _checkSprite(s[i])) {
+            continue;
+        }
+        sp = &sprites[s[i] - 1];
+
+        // draw the sprites of the previous page
+        if (n > 0 && (sp->page != page || n == BATCH_SIZE)) {
+            DFBCHECK(primary->BatchBlit(primary, pages[page].surface,
+                                            batch.rects, batchpts, n));
+            n = 0;
+        }
+        if (n == 0) {
+            _applyBlittingFlags(alpha ? DSBLIT_BLEND_ALPHACHANNEL
+                                      : DSBLIT_NOFX);
+        }
+
+        page           = sp->page;
+        batch.rects[n] = sp->rect;
+        batchpts[n].x  = p[i].x;
+        batchpts[n].y  = p[i].y;
+        n++;
+        _damageRect(p[i].x, p[i].y, sp->rect.w, sp->rect.h);
+    }
+
+    if (n > 0) {
+        DFBCHECK(primary->BatchBlit(primary, pages[page].surface,
+                                        batch.rects, batchpts, n));
+    }
+
+}
+
+
+/**
+ * Render the sprite into the region
+ * @param s handle of the sprite
+ * @param to region of the destination surface
+ * @param alpha enable alpha blending on true
+ */
+void stretchSprite (sprite_t s, region_t to, bool alpha)
+{
+
+    const spriteslot_t *    sp;
+    command_t *             c;
+
+    PROF_SCOPE(stretchSprite);
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_STRETCH)) != NULL) {
+        // tables may be grown by addSprites() while contexts record
+        pthread_mutex_lock(&imageLock);
+        if (! _checkSprite(s)) {
+            pthread_mutex_unlock(&imageLock);
+            _unrecord();
+            return;
+        }
+        sp             = &sprites[s - 1];
+        c->alpha       = alpha;
+        _holdSource(c, pages[sp->page].surface);
+        c->g.blit.from = sp->rect;
+        pthread_mutex_unlock(&imageLock);
+        c->g.blit.to   = to;
+        _queued(c, to.x, to.y, to.x + to.w - 1, to.y + to.h - 1);
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL || ! _checkSprite(s)) {
+        return;
+    }
+    sp = &sprites[s - 1];
+
+    // set setting of blending
+    _applyBlittingFlags(alpha ? DSBLIT_BLEND_ALPHACHANNEL : DSBLIT_NOFX);
+
+    DFBCHECK(primary->StretchBlit(primary, pages[sp->page].surface,
+                                                        &sp->rect, &to));
+    _damageRect(to.x, to.y, to.w, to.h);
+
+}
+
+
+/**
+ * Draw rectangle on primary surface
+ * @param r region
+ * @param fill fill the rectangle on true
+ */
+void rectangle (region_t r, bool fill)
+{
+
+    command_t *             c;
+
+    PROF_SCOPE(rectangle);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if ((c = _record(fill ? CMD_FILLRECT : CMD_DRAWRECT)) != NULL) {
+        c->g.rect = r;
+        _queued(c, r.x, r.y, r.x + r.w - 1, r.y + r.h - 1);
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    // draw rectangle
+    _applyColor(ccolor);
+    if (fill) {
+        DFBCHECK(primary->FillRectangle(primary, r.x, r.y, r.w, r.h));
+    } else {
+        DFBCHECK(primary->DrawRectangle(primary, r.x, r.y, r.w, r.h));
+    }
+    _damageRect(r.x, r.y, r.w, r.h);
+
+}
+
+
+/**
+ * Draw line
+ * @param from starting point
+ * @param to terminating point
+ */
+void line (position_t from, position_t to)
+{
+
+    command_t *             c;
+
+    PROF_SCOPE(line);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_LINE)) != NULL) {
+        c->g.line.x1 = from.x;
+        c->g.line.y1 = from.y;
+        c->g.line.x2 = to.x;
+        c->g.line.y2 = to.y;
+        _queued(c, MIN(from.x, to.x), MIN(from.y, to.y),
+                   MAX(from.x, to.x), MAX(from.y, to.y));
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    _applyColor(ccolor);
+    DFBCHECK(primary->DrawLine(primary, from.x, from.y, to.x, to.y));
+    _addDamage(MIN(from.x, to.x), MIN(from.y, to.y),
+               MAX(from.x, to.x), MAX(from.y, to.y));
+
+}
+
+
+/**
+ * Draw connected lines through the points
+ * @param points array of the points
+ * @param num number of the points
+ */
+void polyline (const position_t *points, int num)
+{
+
+    int                     x1, y1, x2, y2;
+    int                     n;
+    int                     i;
+
+    PROF_SCOPE(polyline);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // record or queue each segment in deferred mode, batched on submission
+    if (deferred || context != NULL) {
+        for (i = 1; i < num; i++) {
+            line(points[i - 1], points[i]);
+        }
+        return;
+    }
+
+    _applyColor(ccolor);
+
+    // draw the segments by chunks of the scratch array
+    i = 1;
+    while (i < num) {
+        x1 = x2 = points[i - 1].x;
+        y1 = y2 = points[i - 1].y;
+        for (n = 0; n < BATCH_SIZE && i < num; n++, i++) {
+            batch.lines[n].x1 = points[i - 1].x;
+            batch.lines[n].y1 = points[i - 1].y;
+            batch.lines[n].x2 = points[i].x;
+            batch.lines[n].y2 = points[i].y;
+            x1 = MIN(x1, points[i].x);
+            y1 = MIN(y1, points[i].y);
+            x2 = MAX(x2, points[i].x);
+            y2 = MAX(y2, points[i].y);
+        }
+        DFBCHECK(primary->DrawLines(primary, batch.lines, n));
+        _addDamage(x1, y1, x2, y2);
+    }
+
+}
+
+
+/**
+ * Create a stroke to append points incrementally
+ * @return stroke on success, NULL on failure
+ */
+stroke_t * createStroke (void)
+{
+
+    stroke_t *              s;
+
+    s = malloc(sizeof(stroke_t));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->points = malloc(STROKE_INITIAL * sizeof(position_t));
+    if (s->points == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->num    = 0;
+    s->max    = STROKE_INITIAL;
+    s->drawn  = 0;
+    s->under  = NULL;
+    s->tipped = false;
+
+    return s;
+
+}
+
+
+/**
+ * Append a point to the stroke
+ * @param s stroke
+ * @param p point
+ * @return true on success, false otherwise
+ */
+bool appendStroke (stroke_t *s, position_t p)
+{
+
+    position_t *            points;
+
+    // grow the array
+    if (s->num == s->max) {
+        points = realloc(s->points, s->max * 2 * sizeof(position_t));
+        if (points == NULL) {
+            return false;
+        }
+        s->points = points;
+        s->max   *= 2;
+    }
+
+    s->points[s->num++] = p;
+
+    return true;
+
+}
+
+
+/**
+ * Draw the segments appended since the last call
+ * The tip drawn by drawStrokeTip() is erased.
+ * @param s stroke
+ */
+void drawStroke (stroke_t *s)
+{
+
+    int                     from;
+
+    PROF_SCOPE(drawStroke);
+
+    // restore the pixels under the tip
+    if (s->tipped) {
+        _flushCommands();
+        _applyBlittingFlags(DSBLIT_NOFX);
+        DFBCHECK(primary->Blit(primary, s->under, NULL, s->tip.x, s->tip.y));
+        _damageRect(s->tip.x, s->tip.y, s->tip.w, s->tip.h);
+        s->tipped = false;
+    }
+
+    // start from the last point drawn
+    from = (s->drawn > 0) ? s->drawn - 1 : 0;
+    if (s->num - from < 2) {
+        return;
+    }
+
+    polyline(s->points + from, s->num - from);
+    s->drawn = s->num;
+
+}
+
+
+/**
+ * Draw the stroke with a provisional tip to the predicted position
+ * The tip is replaced by the real segments on the next call, and erased
+ * by drawStroke(). This needs setBackBufferSync(), otherwise only the
+ * stroke is drawn.
+ * @param s stroke
+ */
+void drawStrokeTip (stroke_t *s)
+{
+
+    DFBSurfaceDescription   desc;
+    DFBRegion               r;
+    position_t              tip[2];
+
+    drawStroke(s);
+
+    if (! backSync || predictKind == PREDICT_NONE || s->num == 0) {
+        return;
+    }
+
+    // segment from the last point to the prediction, clipped
+    tip[0]   = s->points[s->num - 1];
+    tip[1]   = predictPosition();
+    tip[1].x = tip[0].x + MAX(MIN(tip[1].x - tip[0].x, PREDICT_MAXDIST),
+                                                        -PREDICT_MAXDIST);
+    tip[1].y = tip[0].y + MAX(MIN(tip[1].y - tip[0].y, PREDICT_MAXDIST),
+                                                        -PREDICT_MAXDIST);
+    r.x1   = MAX(MIN(tip[0].x, tip[1].x), 0);
+    r.y1   = MAX(MIN(tip[0].y, tip[1].y), 0);
+    r.x2   = MIN(MAX(tip[0].x, tip[1].x), xres - 1);
+    r.y2   = MIN(MAX(tip[0].y, tip[1].y), yres - 1);
+    if (r.x1 > r.x2 || r.y1 > r.y2) {
+        return;
+    }
+
+    // surface to save the pixels under the tip
+    if (s->under == NULL) {
+        desc.flags  = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+        desc.width  = PREDICT_MAXDIST + 1;
+        desc.height = PREDICT_MAXDIST + 1;
+        DFBCHECK(primary->GetPixelFormat(primary, &desc.pixelformat));
+        if (dfb->CreateSurface(dfb, &desc, &s->under) != DFB_OK) {
+            s->under = NULL;
+            return;
+        }
+    }
+
+    s->tip.x = r.x1;
+    s->tip.y = r.y1;
+    s->tip.w = r.x2 - r.x1 + 1;
+    s->tip.h = r.y2 - r.y1 + 1;
+
+    // save and draw
+    _flushCommands();
+    DFBCHECK(s->under->Blit(s->under, primary, &s->tip, 0, 0));
+    s->tipped = true;
+    polyline(tip, 2);
+
+}
+
+
+/**
+ * Remove all the points from the stroke
+ * The tip is forgotten without erasing it.
+ * @param s stroke
+ */
+void clearStroke (stroke_t *s)
+{
+
+    s->num    = 0;
+    s->drawn  = 0;
+    s->tipped = false;
+
+}
+
+
+/**
+ * Release the stroke
+ * @param s stroke
+ */
+void releaseStroke (stroke_t *s)
+{
+
+    if (s == NULL) {
+        return;
+    }
+
+    if (s->under != NULL) {
+        s->under->Release(s->under);
+    }
+    free(s->points);
+    free(s);
+
+}
+
+
+/**
+ * Draw triangle
+ * @param p1
+ * @param p2
+ * @param p3
+ */
+void triangle (position_t p1, position_t p2, position_t p3)
+{
+
+    command_t *             c;
+
+    PROF_SCOPE(triangle);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_TRIANGLE)) != NULL) {
+        c->g.tri.x1 = p1.x;
+        c->g.tri.y1 = p1.y;
+        c->g.tri.x2 = p2.x;
+        c->g.tri.y2 = p2.y;
+        c->g.tri.x3 = p3.x;
+        c->g.tri.y3 = p3.y;
+        _queued(c, MIN(p1.x, MIN(p2.x, p3.x)), MIN(p1.y, MIN(p2.y, p3.y)),
+                   MAX(p1.x, MAX(p2.x, p3.x)), MAX(p1.y, MAX(p2.y, p3.y)));
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    _applyColor(ccolor);
+    DFBCHECK(primary->FillTriangle(primary, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y));
+    _addDamage(MIN(p1.x, MIN(p2.x, p3.x)), MIN(p1.y, MIN(p2.y, p3.y)),
+               MAX(p1.x, MAX(p2.x, p3.x)), MAX(p1.y, MAX(p2.y, p3.y)));
+
+}
+
+
+/**
+ * Get screen size 
+ * @return screen size
+ */
+scsize_t getSize (void)
+{
+
+    scsize_t            res = {-1 , -1};
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return res;
+    }
+
+    res.w = xres;
+    res.h = yres;
+
+    return res;
+
+}
+
+
+/**
+ * Get surface size 
+ * @return surface size 
+ */
+scsize_t getSurfaceSize (int index)
+{
+
+    scsize_t            s = {-1, -1};
+
+    // check if the image is available
+    if (! _checkSurface(index)) {
+        return s;
+    }
+
+    DFBCHECK(images[index].surface->GetSize(images[index].surface, &s.w, &s.h));
+
+    return s;
+
+}
+
+
+/**
+ * Get the font of the handle and mark it as used
+ * The font must be locked by the caller.
+ * @param f handle of the font
+ * @return font, NULL if the handle is not valid
+ */
+static IDirectFBFont * _getFont (font_t f)
+{
+
+    int                     i = FONT_INDEX(f);
+
+    if (f == FONT_NONE || i >= FONT_CACHE_SIZE || fonts[i].font == NULL ||
+            fonts[i].generation != FONT_GENERATION(f)) {
+        return NULL;
+    }
+    fonts[i].used = ++fonttick;
+
+    return fonts[i].font;
+
+}
+
+
+/**
+ * Set the font to the primary surface unless it is already set
+ * The font must be locked by the caller.
+ * @param f font, NULL to unset
+ */
+static void _applyFont (IDirectFBFont *f)
+{
+
+    if (primaryFont != f) {
+        DFBCHECK(primary->SetFont(primary, f));
+        primaryFont = f;
+    }
+
+}
+
+
+/**
+ * Release the font in the registry slot
+ * Handles of the font become invalid.
+ * The font must be locked by the caller.
+ * @param i index of the slot
+ */
+static void _releaseFont (int i)
+{
+
+    if (fonts[i].font == NULL) {
+        return;
+    }
+
+    if (primaryFont == fonts[i].font) {
+        _applyFont(NULL);
+    }
+    fonts[i].font->Release(fonts[i].font);
+    fonts[i].font = NULL;
+    free(fonts[i].path);
+    fonts[i].path = NULL;
+
+}
+
+
+/**
+ * Last use of the font in the registry slot, for _lruSlot()
+ * The current font is kept. The font must be locked by the caller.
+ * @param i index of the slot
+ * @return last use, 0 if empty, ULONG_MAX if current
+ */
+static unsigned long _fontUsed (int i)
+{
+
+    if (fonts[i].font == NULL) {
+        return 0;
+    }
+    if (FONT_HANDLE(i, fonts[i].generation) == curfont) {
+        return ULONG_MAX;
+    }
+
+    return fonts[i].used;
+
+}
+
+
+/**
+ * Load the font into the registry
+ * The font loaded before with the same path and size is shared. If the
+ * registry is full, the least recently used font other than the current
+ * one is released.
+ * @param path path to the font file
+ * @param size font size
+ * @return handle of the font, FONT_NONE on failure
+ */
+font_t loadFont (const char * path, int size)
+{
+
+    IDirectFBFont *         f;
+    font_t                  h = FONT_NONE;
+    char *                  copy;
+    int                     slot = -1;
+    int                     i;
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return FONT_NONE;
+    }
+
+    // lock
+    pthread_mutex_lock(&fontLock);
+
+    // loaded before
+    for (i = 0; i < FONT_CACHE_SIZE; i++) {
+        if (fonts[i].font != NULL && fonts[i].size == size &&
+                strcmp(fonts[i].path, path) == 0) {
+            fonts[i].used = ++fonttick;
+            h = FONT_HANDLE(i, fonts[i].generation);
+            goto out;
+        }
+    }
+
+    // empty slot, or the least recently used one
+    slot = _lruSlot(FONT_CACHE_SIZE, _fontUsed);
+    if (slot < 0) {
+        goto out;
+    }
+
+    // specify size
+    fdsc.flags  = DFDESC_HEIGHT;
+    fdsc.height = size;
+
+    // create font
+    copy = strdup(path);
+    if (copy == NULL) {
+        goto out;
+    }
+    if (dfb->CreateFont(dfb, path, &fdsc, &f) != DFB_OK) {
+        free(copy);
+        goto out;
+    }
+
+    // replace the font in the slot
+    _releaseFont(slot);
+    fonts[slot].generation = _nextGeneration(fonts[slot].generation,
+                                                        FONT_INDEX_BITS);
+    fonts[slot].font = f;
+    fonts[slot].path = copy;
+    fonts[slot].size = size;
+    fonts[slot].used = ++fonttick;
+    h = FONT_HANDLE(slot, fonts[slot].generation);
+
+out:
+    // unlock
+    pthread_mutex_unlock(&fontLock);
+
+    return h;
+
+}
+
+
+/**
+ * Select the font loaded into the registry as the current font
+ * No file is loaded, so switching fonts costs nothing.
+ * @param f handle of the font
+ * @return true on success, false if the handle is not valid
+ */
+bool useFont (font_t f)
+{
+
+    IDirectFBFont *         p;
+
+    // lock
+    pthread_mutex_lock(&fontLock);
+
+    p = _getFont(f);
+    if (p != NULL) {
+        font    = p;
+        curfont = f;
+        _applyFont(p);
+    }
+
+    // unlock
+    pthread_mutex_unlock(&fontLock);
+
+    return p != NULL;
+
+}
+
+
+/**
+ * Set font to the primary surface
+ * The font is kept in the registry, and setting it again is cheap.
+ * @param path path to the font file
+ * @param size font size
+ * @return true on success, false otherwise
+ */
+bool setFont (const char * path, int size)
+{
+
+    return useFont(loadFont(path, size));
+
+}
+
+
+/**
+ * Calculate string width
+ * @param text text to draw
+ * @return string width, -1 on error
+ */
+int stringWidth (const char * text)
+{
+
+    return stringWidthFont(curfont, text);
+
+}
+
+
+/**
+ * Calculate string width in the font
+ * @param f handle of the font
+ * @param text text to draw
+ * @return string width, -1 on error
+ */
+int stringWidthFont (font_t f, const char * text)
+{
+
+    IDirectFBFont *         p;
+    int                     width = -1;
+
+    // lock
+    pthread_mutex_lock(&fontLock);
+
+    p = _getFont(f);
+    if (p != NULL) {
+        DFBCHECK(p->GetStringWidth(p, text, -1, &width));
+    }
+
+    // unlock
+    pthread_mutex_unlock(&fontLock);
+
+    return width;
+
+}
+
+
+/**
+ * Draw left aligned text on the primary surface
+ * @param text text to draw
+ * @param p position
+ */
+void putString (const char * text, position_t p)
+{
+
+    putStringAligned(text, p, DSTF_LEFT); 
+
+}
+
+
+/**
+ * Draw aligned text on the primary surface
+ * @param text text to draw
+ * @param p position
+ */
+void putStringAligned (const char * text, position_t p, DFBSurfaceTextFlags flg)
+{
+
+    putStringFont(curfont, text, p, flg);
+
+}
+
+
+/**
+ * Draw aligned text in the font on the primary surface
+ * The current font is not changed.
+ * @param f handle of the font
+ * @param text text to draw
+ * @param p position
+ * @param flg alignment
+ */
+void putStringFont (font_t f, const char * text, position_t p,
+                        DFBSurfaceTextFlags flg)
+{
+
+    IDirectFBFont *         font;
+
+    PROF_SCOPE(putString);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // draw the deferred commands first
+    _flushCommands();
+
+    // lock
+    pthread_mutex_lock(&fontLock);
+
+    // draw string
+    font = _getFont(f);
+    if (font != NULL) {
+        _applyFont(font);
+        _applyColor(ccolor);
+        DFBCHECK (primary->DrawString(primary, text, -1, p.x, p.y, flg));
+        _damageText(font, text, p, flg);
+    }
+
+    // unlock
+    pthread_mutex_unlock(&fontLock);
+
+}
+
+
+/**
+ * Check if two colors are the same
+ * @return true if the same
+ */
+static inline bool _sameColor (color_t a, color_t b)
+{
+
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+
+}
+
+
+/**
+ * Hash of the rendered text
+ * @return index of the hash chain
+ */
+static unsigned int _hashText (const char *text, unsigned int serial,
+                                color_t c)
+{
+
+    unsigned int            h = 2166136261u;
+
+    // FNV-1a
+    for (; *text != '\0'; text++) {
+        h = (h ^ (unsigned char)*text) * 16777619u;
+    }
+    h ^= serial * 2654435761u;
+    h ^= ((unsigned int)c.r << 24) | (c.g << 16) | (c.b << 8) | c.a;
+
+    return h & (TEXT_HASH - 1);
+
+}
+
+
+/**
+ * Remove the rendered text from the LRU list
+ * @param t rendered text
+ */
+static void _unlinkText (text_t *t)
+{
+
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        texthead = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    } else {
+        texttail = t->prev;
+    }
+
+}
+
+
+/**
+ * Put the rendered text at the head of the LRU list
+ * @param t rendered text
+ */
+static void _linkText (text_t *t)
+{
+
+    t->prev = NULL;
+    t->next = texthead;
+    if (texthead != NULL) {
+        texthead->prev = t;
+    } else {
+        texttail = t;
+    }
+    texthead = t;
+
+}
+
+
+/**
+ * Destroy the rendered text
+ * @param t rendered text
+ */
+static void _destroyText (text_t *t)
+{
+
+    text_t **               pp;
+
+    // hash chain
+    pp = &texthash[_hashText(t->text, t->font, t->color)];
+    while (*pp != t) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = t->hnext;
+
+    _unlinkText(t);
+    ntexts--;
+
+    pthread_mutex_lock(&imageLock);
+    t->surface->Release(t->surface);
+    pthread_mutex_unlock(&imageLock);
+    free(t->text);
+    free(t);
+
+}
+
+
+/**
+ * Render the text into a new surface
+ * The text is drawn in white on black, then the brightness is turned
+ * into the alpha channel of the color. The font must be locked.
+ * @param f handle of the font
+ * @param font font
+ * @param text text
+ * @param c color
+ * @return rendered text, NULL on failure
+ */
+static text_t * _renderText (font_t f, IDirectFBFont *font,
+                                const char *text, color_t c)
+{
+
+    DFBSurfaceDescription   d;
+    DFBRectangle            logical;
+    DFBRectangle            ink;
+    DFBRegion               r;
+    DFBRegion               i;
+    IDirectFBSurface *      s;
+    text_t *                t;
+    void *                  data;
+    uint32_t *              row;
+    uint32_t                rgb;
+    int                     pitch;
+    int                     x;
+    int                     y;
+
+    // extents relative to the origin on the base line
+    DFBCHECK(font->GetStringExtents(font, text, -1, &logical, &ink));
+    r.x1 = logical.x;
+    r.y1 = logical.y;
+    r.x2 = logical.x + MAX(logical.w, 1) - 1;
+    r.y2 = logical.y + MAX(logical.h, 1) - 1;
+    if (ink.w > 0 && ink.h > 0) {
+        i.x1 = ink.x;
+        i.y1 = ink.y;
+        i.x2 = ink.x + ink.w - 1;
+        i.y2 = ink.y + ink.h - 1;
+        _unionRegion(&r, &i);
+    }
+
+    t = calloc(1, sizeof(text_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->text = strdup(text);
+
+    d.flags       = DSDESC_HEIGHT | DSDESC_WIDTH | DSDESC_PIXELFORMAT;
+    d.pixelformat = DSPF_ARGB;
+    d.width       = r.x2 - r.x1 + 1;
+    d.height      = r.y2 - r.y1 + 1;
+    if (t->text == NULL || dfb->CreateSurface(dfb, &d, &s) != DFB_OK) {
+        free(t->text);
+        free(t);
+        return NULL;
+    }
+
+    // coverage of the glyphs
+    DFBCHECK(s->Clear(s, 0, 0, 0, 0xff));
+    DFBCHECK(s->SetFont(s, font));
+    DFBCHECK(s->SetColor(s, 0xff, 0xff, 0xff, 0xff));
+    DFBCHECK(s->DrawString(s, text, -1, -r.x1, -r.y1, DSTF_LEFT));
+    DFBCHECK(s->SetFont(s, NULL));
+
+    // coverage into alpha
+    rgb = ((uint32_t)c.r << 16) | ((uint32_t)c.g << 8) | c.b;
+    DFBCHECK(s->Lock(s, DSLF_READ | DSLF_WRITE, &data, &pitch));
+    for (y = 0; y < d.height; y++) {
+        row = (uint32_t *)((char *)data + y * pitch);
+        for (x = 0; x < d.width; x++) {
+            row[x] = ((((row[x] >> 16) & 0xff) * c.a / 0xff) << 24) | rgb;
+        }
+    }
+    DFBCHECK(s->Unlock(s));
+
+    // layout
+    t->font    = f;
+    t->color   = c;
+    t->surface = s;
+    t->ox      = r.x1;
+    t->oy      = r.y1;
+    DFBCHECK(font->GetStringWidth(font, text, -1, &t->width));
+    DFBCHECK(font->GetAscender(font, &t->ascender));
+    DFBCHECK(font->GetDescender(font, &t->descender));
+
+    return t;
+
+}
+
+
+/**
+ * Create the text object of the string in the current font and color
+ * @param text text
+ * @return text object, NULL on failure
+ */
+text_t * createText (const char * text)
+{
+
+    return createTextFont(curfont, text);
+
+}
+
+
+/**
+ * Create the text object of the string in the font and current color
+ * The string is laid out and rendered once, and shared with the same
+ * string in the same font, size and color until evicted from the cache.
+ * @param f handle of the font
+ * @param text text
+ * @return text object, NULL on failure
+ */
+text_t * createTextFont (font_t f, const char * text)
+{
+
+    IDirectFBFont *         font;
+    text_t *                t;
+    text_t *                old;
+    text_t *                prev;
+    unsigned int            h;
+
+    if (primary == NULL) {
+        return NULL;
     }
 
     // lock
     pthread_mutex_lock(&fontLock);
 
-    // specify size
-    fdsc.flags  = DFDESC_HEIGHT;
-    fdsc.height = size;
+    // check if the font is available
+    font = _getFont(f);
+    if (font == NULL) {
+        pthread_mutex_unlock(&fontLock);
+        return NULL;
+    }
+
+    // rendered before
+    h = _hashText(text, f, ccolor);
+    for (t = texthash[h]; t != NULL; t = t->hnext) {
+        if (t->font == f && strcmp(t->text, text) == 0 &&
+                _sameColor(t->color, ccolor)) {
+            break;
+        }
+    }
+
+    if (t != NULL) {
+        _unlinkText(t);
+    } else {
+        t = _renderText(f, font, text, ccolor);
+        if (t != NULL) {
+            t->hnext    = texthash[h];
+            texthash[h] = t;
+            ntexts++;
+        }
+    }
+
+    if (t != NULL) {
+        t->refs++;
+        _linkText(t);
+    }
+
+    // evict the least recently used texts
+    for (old = texttail; ntexts > TEXT_CACHE_SIZE && old != NULL;
+                                                            old = prev) {
+        prev = old->prev;
+        if (old->refs == 0) {
+            _destroyText(old);
+        }
+    }
+
+    // unlock
+    pthread_mutex_unlock(&fontLock);
+
+    return t;
+
+}
+
+
+/**
+ * Release the text object
+ * The rendered text is kept in the cache.
+ * @param t text object
+ */
+void releaseText (text_t * t)
+{
+
+    if (t == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fontLock);
+    t->refs--;
+    pthread_mutex_unlock(&fontLock);
+
+}
 
-    // create font
-    DFBCHECK(dfb->CreateFont(dfb, path, &fdsc, &font));
 
-    // set font
-    DFBCHECK(primary->SetFont(primary, font));
+/**
+ * Get the size of the text object
+ * @param t text object
+ * @return width of the string and height of the font
+ */
+scsize_t textSize (const text_t * t)
+{
+
+    scsize_t                size = {-1, -1};
+
+    if (t != NULL) {
+        size.w = t->width;
+        size.h = t->ascender - t->descender;
+    }
+
+    return size;
+
+}
+
+
+/**
+ * Draw the text object on the primary surface
+ * This is a single blit, neither the font nor its lock is used.
+ * @param t text object
+ * @param p position
+ * @param flg alignment, same as putStringAligned()
+ */
+void putText (const text_t * t, position_t p, DFBSurfaceTextFlags flg)
+{
+
+    command_t *             c;
+    int                     w;
+    int                     h;
+
+    PROF_SCOPE(putText);
+
+    if (primary == NULL || t == NULL) {
+        return;
+    }
+
+    // horizontal alignment
+    if (flg & DSTF_RIGHT) {
+        p.x -= t->width;
+    } else
+    if (flg & DSTF_CENTER) {
+        p.x -= t->width / 2;
+    }
+
+    // vertical alignment, descender is negative
+    if (flg & DSTF_TOP) {
+        p.y += t->ascender;
+    } else
+    if (flg & DSTF_BOTTOM) {
+        p.y += t->descender;
+    }
+
+    // top left of the surface
+    p.x += t->ox;
+    p.y += t->oy;
+    DFBCHECK(t->surface->GetSize(t->surface, &w, &h));
+
+    // record or queue in deferred mode
+    if ((c = _record(CMD_BLIT)) != NULL) {
+        c->alpha         = true;
+        pthread_mutex_lock(&imageLock);
+        _holdSource(c, t->surface);
+        pthread_mutex_unlock(&imageLock);
+        c->g.blit.from.x = 0;
+        c->g.blit.from.y = 0;
+        c->g.blit.from.w = w;
+        c->g.blit.from.h = h;
+        c->g.blit.to.x   = p.x;
+        c->g.blit.to.y   = p.y;
+        c->g.blit.to.w   = w;
+        c->g.blit.to.h   = h;
+        _queued(c, p.x, p.y, p.x + w - 1, p.y + h - 1);
+        return;
+    }
+
+    // threads with a context never draw immediately
+    if (context != NULL) {
+        return;
+    }
+
+    _applyBlittingFlags(DSBLIT_BLEND_ALPHACHANNEL);
+    DFBCHECK(primary->Blit(primary, t->surface, NULL, p.x, p.y));
+    _damageRect(p.x, p.y, w, h);
+
+}
+
+
+/**
+ * Draw aligned text through the text cache
+ * Same as putStringAligned(), but the string is rendered only once.
+ * @param text text to draw
+ * @param p position
+ * @param flg alignment
+ */
+void putStringCached (const char * text, position_t p, DFBSurfaceTextFlags flg)
+{
+
+    text_t *                t;
+
+    t = createText(text);
+    if (t == NULL) {
+        return;
+    }
+
+    putText(t, p, flg);
+    releaseText(t);
+
+}
+
+
+/**
+ * Unset font
+ * The font is kept in the registry.
+ */
+void unsetFont (void)
+{
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // lock
+    pthread_mutex_lock(&fontLock);
+
+    // unset font
+    _applyFont(NULL);
+    font    = NULL;
+    curfont = FONT_NONE;
 
     // unlock
     pthread_mutex_unlock(&fontLock);
 
-    return true;
+}
+
+
+/**
+ * Size class of the pooled surfaces
+ * @param n width or height
+ * @return class, the size is POOL_MIN << class, -1 if too large
+ */
+static int _sizeClass (int n)
+{
+
+    int                     c = 0;
+
+    while ((POOL_MIN << c) < n) {
+        if (++c == POOL_CLASSES) {
+            return -1;
+        }
+    }
+
+    return c;
 
 }
 
 
 /**
- * Calculate string width
- * @param text text to draw
- * @return string width, -1 on error
+ * Get an ARGB surface of at least the size from the pool
+ * A new surface of the size class is created if the pool is empty.
+ * @param w width
+ * @param h height
+ * @return surface
  */
-int stringWidth (const char * text)
+static IDirectFBSurface * _poolGet (int w, int h)
+{
+
+    DFBSurfaceDescription   d;
+    IDirectFBSurface *      s;
+    surfpool_t *            pool;
+    int                     cw = _sizeClass(w);
+    int                     ch = _sizeClass(h);
+
+    // reuse a free surface
+    if (cw >= 0 && ch >= 0) {
+        pool = &pools[cw][ch];
+        if (pool->num > 0) {
+            return pool->surfaces[--pool->num];
+        }
+        w = POOL_MIN << cw;
+        h = POOL_MIN << ch;
+    }
+
+    // create a surface
+    d.flags       = DSDESC_HEIGHT | DSDESC_WIDTH | DSDESC_PIXELFORMAT;
+    d.pixelformat = DSPF_ARGB;
+    d.width       = w;
+    d.height      = h;
+    DFBCHECK(dfb->CreateSurface(dfb, &d, &s));
+    poolbytes += (size_t)w * h * DFB_BYTES_PER_PIXEL(DSPF_ARGB);
+
+    return s;
+
+}
+
+
+/**
+ * Return the surface to the pool
+ * The surface is released if it is not of a size class, the pool is full
+ * or the surfaces are over POOL_BUDGET.
+ * @param s surface
+ */
+static void _poolPut (IDirectFBSurface *s)
+{
+
+    surfpool_t *            pool;
+    int                     w;
+    int                     h;
+    int                     cw;
+    int                     ch;
+
+    DFBCHECK(s->GetSize(s, &w, &h));
+    cw = _sizeClass(w);
+    ch = _sizeClass(h);
+
+    if (cw >= 0 && ch >= 0 && (POOL_MIN << cw) == w && (POOL_MIN << ch) == h &&
+            poolbytes <= POOL_BUDGET) {
+        pool = &pools[cw][ch];
+        if (pool->num < POOL_DEPTH) {
+            pool->surfaces[pool->num++] = s;
+            return;
+        }
+    }
+
+    poolbytes -= (size_t)w * h * DFB_BYTES_PER_PIXEL(DSPF_ARGB);
+    s->Release(s);
+
+}
+
+
+/**
+ * Release all the surfaces in the pool
+ */
+static void _drainPools (void)
+{
+
+    surfpool_t *            pool;
+    int                     i;
+    int                     j;
+
+    for (i = 0; i < POOL_CLASSES; i++) {
+        for (j = 0; j < POOL_CLASSES; j++) {
+            pool = &pools[i][j];
+            while (pool->num > 0) {
+                pool->num--;
+                poolbytes -= (size_t)(POOL_MIN << i) * (POOL_MIN << j) *
+                                            DFB_BYTES_PER_PIXEL(DSPF_ARGB);
+                pool->surfaces[pool->num]->Release(pool->surfaces[pool->num]);
+            }
+        }
+    }
+
+}
+
+
+/**
+ * Release the free surfaces in the pool, the largest first, until the
+ * surfaces are within POOL_BUDGET
+ */
+static void _trimPools (void)
+{
+
+    surfpool_t *            pool;
+    int                     i;
+    int                     j;
+
+    for (i = POOL_CLASSES - 1; i >= 0; i--) {
+        for (j = POOL_CLASSES - 1; j >= 0; j--) {
+            pool = &pools[i][j];
+            while (pool->num > 0 && poolbytes > POOL_BUDGET) {
+                pool->num--;
+                poolbytes -= (size_t)(POOL_MIN << i) * (POOL_MIN << j) *
+                                            DFB_BYTES_PER_PIXEL(DSPF_ARGB);
+                pool->surfaces[pool->num]->Release(pool->surfaces[pool->num]);
+            }
+        }
+    }
+
+}
+
+
+/**
+ * Hash of the message box
+ * @return index of the hash chain
+ */
+static unsigned int _hashBox (const char *message, font_t f, region_t r,
+                                position_t off, color_t fg, color_t bg)
+{
+
+    unsigned int            h;
+
+    h  = _hashText(message, f, fg);
+    h ^= _hashText("", r.w * 31 + r.h, bg);
+    h ^= (unsigned int)(off.x * 7 + off.y);
+
+    return h & (BOX_HASH - 1);
+
+}
+
+
+/**
+ * Remove the message box from the LRU list
+ * @param b message box
+ */
+static void _unlinkBox (msgbox_t *b)
+{
+
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        boxhead = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    } else {
+        boxtail = b->prev;
+    }
+
+}
+
+
+/**
+ * Put the message box at the head of the LRU list
+ * @param b message box
+ */
+static void _linkBox (msgbox_t *b)
+{
+
+    b->prev = NULL;
+    b->next = boxhead;
+    if (boxhead != NULL) {
+        boxhead->prev = b;
+    } else {
+        boxtail = b;
+    }
+    boxhead = b;
+
+}
+
+
+/**
+ * Destroy the message box and return its surface to the pool
+ * @param b message box
+ */
+static void _destroyBox (msgbox_t *b)
+{
+
+    msgbox_t **             pp;
+
+    // hash chain
+    pp = &boxhash[_hashBox(b->message, b->font, b->r, b->off, b->fg, b->bg)];
+    while (*pp != b) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = b->hnext;
+
+    _unlinkBox(b);
+    nboxes--;
+
+    _poolPut(b->surface);
+    free(b->message);
+    free(b);
+
+}
+
+
+/**
+ * Find the message box rendered before
+ * The font must be locked by the caller.
+ * @return message box, NULL if not found
+ */
+static msgbox_t * _findBox (const char *message, region_t r,
+                                position_t off, color_t fg, color_t bg)
+{
+
+    msgbox_t *              b;
+
+    b = boxhash[_hashBox(message, curfont, r, off, fg, bg)];
+    for (; b != NULL; b = b->hnext) {
+        if (b->font == curfont && b->r.w == r.w && b->r.h == r.h &&
+                b->off.x == off.x && b->off.y == off.y &&
+                _sameColor(b->fg, fg) && _sameColor(b->bg, bg) &&
+                strcmp(b->message, message) == 0) {
+            _unlinkBox(b);
+            _linkBox(b);
+            return b;
+        }
+    }
+
+    return NULL;
+
+}
+
+
+/**
+ * Render the message box into a pooled surface and keep it in the cache
+ * The font must be locked by the caller.
+ * @return message box, NULL on failure
+ */
+static msgbox_t * _renderBox (const char *message, region_t r,
+                                position_t off, color_t fg, color_t bg)
+{
+
+    IDirectFBSurface *      s;
+    msgbox_t *              b;
+    unsigned int            h;
+
+    b = malloc(sizeof(msgbox_t));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->message = strdup(message);
+    if (b->message == NULL) {
+        free(b);
+        return NULL;
+    }
+
+    // surface of the size class
+    s = _poolGet(r.w, r.h);
+    DFBCHECK(s->SetFont(s, font));
+    DFBCHECK(s->SetDrawingFlags(s, DSDRAW_BLEND));
+
+    // fill background
+    DFBCHECK(s->Clear(s, bg.r, bg.g, bg.b, bg.a));
+
+    // set foreground color
+    DFBCHECK(s->SetColor(s, fg.r, fg.g, fg.b, fg.a));
+
+    // render message
+    DFBCHECK (s->DrawString(s, message, -1,
+                              off.x, r.h + off.y, DSTF_LEFT));
+    DFBCHECK(s->SetFont(s, NULL));
+
+    // keep it
+    b->font    = curfont;
+    b->r       = r;
+    b->off     = off;
+    b->fg      = fg;
+    b->bg      = bg;
+    b->surface = s;
+
+    h          = _hashBox(message, curfont, r, off, fg, bg);
+    b->hnext   = boxhash[h];
+    boxhash[h] = b;
+    _linkBox(b);
+    nboxes++;
+
+    // free surfaces go first, then the least recently used boxes
+    _trimPools();
+    while (nboxes > BOX_CACHE_SIZE ||
+                    (poolbytes > POOL_BUDGET && boxtail != b)) {
+        _destroyBox(boxtail);
+    }
+
+    return b;
+
+}
+
+
+/**
+ * Draw message box
+ * The box rendered before with the same message, font, size, offset and
+ * colors is drawn by a single blit.
+ * @param message message to draw
+ * @param r       region
+ * @param offset  offset
+ * @param ft      foreground color
+ * @param bg      background color
+ */
+void messageBox (const char * message, region_t r,
+                    position_t off, color_t fg, color_t bg)
 {
 
-    int                 width;
+    msgbox_t *              b;
+    command_t *             c;
+    DFBRectangle            from = {0, 0, r.w, r.h};
+
+    PROF_SCOPE(messageBox);
+
+    // check if the primary surface is available
+    if (primary == NULL) {
+        return;
+    }
+
+    // check if the font is available
+    if (font    == NULL) {
+        return;
+    }
+
+    // lock font
+    pthread_mutex_lock(&fontLock);
 
-    // check if the font has already set
-    if (font == NULL) {
-        return -1;
+    // rendered before
+    b = _findBox(message, r, off, fg, bg);
+    if (b == NULL) {
+        // draw the deferred commands first, pooled surfaces may be queued
+        _flushCommands();
+        b = _renderBox(message, r, off, fg, bg);
     }
 
-    // lock
-    pthread_mutex_lock(&fontLock);
+    // queue in deferred mode
+    if (b != NULL && deferred &&
+                    (c = _newCommand(&cmdbuf, CMD_BLIT)) != NULL) {
+        c->alpha         = true;
+        pthread_mutex_lock(&imageLock);
+        _holdSource(c, b->surface);
+        pthread_mutex_unlock(&imageLock);
+        c->g.blit.from   = from;
+        c->g.blit.to     = r;
+        _queued(c, r.x, r.y, r.x + r.w - 1, r.y + r.h - 1);
 
-    DFBCHECK(font->GetStringWidth(font, text, -1, &width));
+    // blit
+    } else if (b != NULL) {
+        _applyBlittingFlags(DSBLIT_BLEND_ALPHACHANNEL);
+        DFBCHECK(primary->Blit(primary, b->surface, &from, r.x, r.y));
+        _damageRect(r.x, r.y, r.w, r.h);
+    }
 
     // unlock
     pthread_mutex_unlock(&fontLock);
 
-    return width;
-
 }
 
 
 /**
- * Draw left aligned text on the primary surface
- * @param text text to draw
- * @param p position
+ * Start the audio engine unless running
+ * The audio thread is run with real-time priority if permitted. The engine
+ * is opened again if the thread has ended on an error of the device.
+ * The audio lock must be held by the caller.
+ * @return true on success, false on failure
  */
-void putString (const char * text, position_t p)
+static bool _startAudio (void)
 {
 
-    putStringAligned(text, p, DSTF_LEFT); 
+    pthread_attr_t          attr;
+    struct sched_param      param;
+    int                     rtn;
+    int                     i;
 
-}
+    if (pcmdev != NULL) {
+        if (__atomic_load_n(&audioRun, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        // the thread gave up on the device, join it and open again
+        _stopAudio();
+    }
 
+    if (! _openAudio()) {
+        return false;
+    }
 
-/**
- * Draw aligned text on the primary surface
- * @param text text to draw
- * @param p position
- */
-void putStringAligned (const char * text, position_t p, DFBSurfaceTextFlags flg)
-{
+    periodBuf = malloc(periodSize * AUDIO_CHANNELS * sizeof(int16_t));
+    mixBuf    = malloc(periodSize * AUDIO_CHANNELS * sizeof(int32_t));
+    if (periodBuf == NULL || mixBuf == NULL) {
+        goto fail;
+    }
 
-    // check if the font has already set
-    if (font == NULL) {
-        return;
+    // double buffer of the music
+    for (i = 0; i < 2; i++) {
+        stream.bufs[i].pcm.samples =
+                    malloc(STREAM_FRAMES * AUDIO_CHANNELS * sizeof(int16_t));
+        if (stream.bufs[i].pcm.samples == NULL) {
+            goto fail;
+        }
     }
+    sem_init(&stream.wake, 0, 0);
+    mpg123_init();
 
-    // lock
-    pthread_mutex_lock(&fontLock);
+    // the clock goes on from the frames written before
+    for (i = 0; i < AUDIO_HISTORY; i++) {
+        marks[i].frame = UINT64_MAX;
+        marks[i].music = -1;
+    }
+    nextMark = 0;
+
+    // real-time thread, or a normal one without the permission
+    __atomic_store_n(&audioRun, true, __ATOMIC_RELEASE);
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = AUDIO_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+    rtn = pthread_create(&audioth, &attr, _audioThread, NULL);
+    pthread_attr_destroy(&attr);
+    if (rtn != 0) {
+        rtn = pthread_create(&audioth, NULL, _audioThread, NULL);
+    }
+    if (rtn != 0) {
+        fprintf(stderr, "Failed to start the audio thread.\n");
+        __atomic_store_n(&audioRun, false, __ATOMIC_RELEASE);
+        sem_destroy(&stream.wake);
+        goto fail;
+    }
 
-    // draw string
-    DFBCHECK (primary->DrawString(primary, text, -1, p.x, p.y, flg));
+    return true;
 
-    // unlock
-    pthread_mutex_unlock(&fontLock);
+fail:
+    free(periodBuf);
+    free(mixBuf);
+    periodBuf = NULL;
+    mixBuf    = NULL;
+    for (i = 0; i < 2; i++) {
+        free(stream.bufs[i].pcm.samples);
+        stream.bufs[i].pcm.samples = NULL;
+    }
+    snd_pcm_close(pcmdev);
+    pcmdev = NULL;
+
+    return false;
 
 }
 
 
 /**
- * Unset font
+ * Stop the music and the audio engine if opened
+ * The audio lock must be held by the caller.
  */
-void unsetFont (void)
+static void _stopAudio (void)
 {
 
-    // check if the font has already set
-    if (font == NULL) {
+    int                     i;
+
+    if (pcmdev == NULL) {
         return;
     }
 
-    // lock
-    pthread_mutex_lock(&fontLock);
-
-    // unset font
-    DFBCHECK(primary->SetFont(primary, NULL));
-
-    // release resource
-    font->Release(font);
-    font = NULL;
-
-    // unlock
-    pthread_mutex_unlock(&fontLock);
+    stopMusic();
+
+    __atomic_store_n(&audioRun, false, __ATOMIC_RELEASE);
+    pthread_join(audioth, NULL);
+    _dropEffects();
+
+    snd_pcm_drop(pcmdev);
+    snd_pcm_close(pcmdev);
+    pcmdev = NULL;
+    free(periodBuf);
+    free(mixBuf);
+    periodBuf = NULL;
+    mixBuf    = NULL;
+    for (i = 0; i < 2; i++) {
+        free(stream.bufs[i].pcm.samples);
+        stream.bufs[i].pcm.samples = NULL;
+    }
+    sem_destroy(&stream.wake);
 
 }
 
 
 /**
- * Draw message box
- * @param message message to draw
- * @param r       region
- * @param offset  offset
- * @param ft      foreground color
- * @param bg      background color
+ * Start the audio engine
+ * The audio thread is run with real-time priority if permitted. The engine
+ * is opened again if the thread has ended on an error of the device.
+ * @return true on success, false on failure
  */
-void messageBox (const char * message, region_t r,
-                    position_t off, color_t fg, color_t bg)
+bool startAudio (void)
 {
 
-    // check if the primary surface is available
-    if (primary == NULL) {
-        return;
-    }
-
-    // check if the font is available
-    if (font    == NULL) {
-        return;
-    }
-    
-    // lock font
-    pthread_mutex_lock(&fontLock);
-
-    // once unset font 
-    DFBCHECK(primary->SetFont(primary, NULL));
-
-    // create a surface    
-    IDirectFBSurface *    s;
-    DFBSurfaceDescription d;
-    d.flags       = DSDESC_HEIGHT | DSDESC_WIDTH | DSDESC_PIXELFORMAT;
-    d.pixelformat = DSPF_ARGB;
-    d.width       = r.w;
-    d.height      = r.h;
-    DFBCHECK(dfb->CreateSurface(dfb, &d, &s));
-    DFBCHECK(s->SetFont(s, font));
-    DFBCHECK(s->SetDrawingFlags(s, DSDRAW_BLEND));
+    bool                    rtn;
 
-    // fill background
-    DFBCHECK(s->Clear(s, bg.r, bg.g, bg.b, bg.a));
+    pthread_mutex_lock(&audioLock);
+    rtn = _startAudio();
+    pthread_mutex_unlock(&audioLock);
 
-    // set foreground color
-    DFBCHECK(s->SetColor(s, fg.r, fg.g, fg.b, fg.a));
-    
-    // render message
-    DFBCHECK (s->DrawString(s, message, -1,
-                              off.x, d.height + off.y, DSTF_LEFT));
+    return rtn;
 
-    // blit
-    DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_BLEND_ALPHACHANNEL));
-    DFBCHECK(primary->Blit(primary, s, NULL, r.x, r.y));
-    DFBCHECK(primary->SetBlittingFlags(primary, DSBLIT_NOFX));
+}
 
-    // release
-    DFBCHECK(s->SetFont(s, NULL));
-    s->Release(s);
 
-    // set font back to the primary surface
-    DFBCHECK(primary->SetFont(primary, font));
+/**
+ * Stop the music and the audio engine
+ */
+void stopAudio (void)
+{
 
-    // unlock
-    pthread_mutex_unlock(&fontLock);
+    pthread_mutex_lock(&audioLock);
+    _stopAudio();
+    pthread_mutex_unlock(&audioLock);
 
 }
 
 
 /**
  * Play music
+ * The audio engine is started if not yet, and the music playing is
+ * stopped. The music is decoded in background through a double buffer,
+ * and sound effects are mixed over it.
  * @param path path to the music file
  * @param back play the music in back ground on true
  */
 void playMusic (const char * path, bool back)
 {
 
-    // check if the font has already set
+    // the engine is kept open until the music is started
+    pthread_mutex_lock(&audioLock);
+
+    // a new music replaces the one playing
+    stopMusic();
+
+    // check the engine, a restart stops the music
+    if (! _startAudio()) {
+        pthread_mutex_unlock(&audioLock);
+        return;
+    }
+
+    // check if the music is being started by another thread
     pthread_mutex_lock(&playLock);
     if (playNow) {
         goto out;
@@ -1094,39 +7667,34 @@ void playMusic (const char * path, bool back)
         goto out;
     }
 
-    // check file type
-    char * command;
-    if (strcmp(path + pathlen - 3, "wav") == 0) {
-        command = aplay;
-    } else
-    if (strcmp(path + pathlen - 3, "mp3") == 0) {
-        command = mpg123;
-    } else {
-        goto out;
-    }
-
-    // make command string
-    sprintf(musicCommand, "%s %s ", command, path);
+    // keep the path for the thread
+    strcpy(musicPath, path);
 
     // play the music
-    playNow = true;        
-    int rtn = pthread_create(&playth, NULL, _playMusic, musicCommand);
-    if (rtn < 0) {
+    playNow = true;
+    __atomic_store_n(&music.stop, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&music.pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stream.seek, -1, __ATOMIC_RELAXED);
+    int rtn = pthread_create(&playth, NULL, _playMusic, musicPath);
+    if (rtn != 0) {
         fprintf(stderr, "Failed to start the thread to play music.\n");
         playNow = false;
         goto out;
     }
-
-    // record time
-    playtime = time(NULL);
+    playJoin = true;
 
     // sync if no background
     if (! back) {
+        playJoin = false;
+        pthread_mutex_unlock(&playLock);
+        pthread_mutex_unlock(&audioLock);
         pthread_join(playth, NULL);
+        return;
     }
 
 out:
     pthread_mutex_unlock(&playLock);
+    pthread_mutex_unlock(&audioLock);
     return;
 
 }
@@ -1137,6 +7705,24 @@ out:
  * @return -1 if not, past seconds otherwise
  */
 int isPlaying (void)
+{
+
+    long                    pos = getMusicPosition();
+
+    if (pos < 0) {
+        return -1;
+    }
+
+    return (int)(pos / audioRate);
+
+}
+
+
+/**
+ * Get the playback position of the music
+ * @return -1 if not playing, frames played otherwise
+ */
+long getMusicPosition (void)
 {
 
     pthread_mutex_lock(&playLock);
@@ -1146,7 +7732,123 @@ int isPlaying (void)
     }
     pthread_mutex_unlock(&playLock);
 
-    return (int)((time(NULL) - playtime));
+    return __atomic_load_n(&music.pos, __ATOMIC_RELAXED);
+
+}
+
+
+/**
+ * Move the playback position of the music
+ * The music restarts from the frame once the decoder has caught up.
+ * @param frame frame of the music
+ * @return true on success, false if not playing
+ */
+bool seekMusic (long frame)
+{
+
+    pthread_mutex_lock(&playLock);
+    if (! playNow) {
+        pthread_mutex_unlock(&playLock);
+        return false;
+    }
+    // the frame is handed to the decoder in 32 bits
+    frame = MAX(frame, 0);
+    if ((unsigned long)frame > UINT32_MAX) {
+        frame = UINT32_MAX;
+    }
+    __atomic_store_n(&stream.seek, frame, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&playLock);
+
+    return true;
+
+}
+
+
+/**
+ * Get the time of the audio heard from the device
+ * The clock counts the frames consumed by the device with sub-millisecond
+ * resolution, and never goes back in a thread.
+ * @return seconds since the engine first started, -1 if not running
+ */
+double getAudioClock (void)
+{
+
+    audioclock_t            c;
+    double                  t;
+
+    if (! _readClock(&c)) {
+        return -1;
+    }
+
+    t         = MAX(lastClock, (c.frames + _sinceClock(&c)) / audioRate);
+    lastClock = t;
+
+    return t;
+
+}
+
+
+/**
+ * Get the time of the music heard from the device
+ * Use this to sync animations, getMusicPosition() is ahead by the buffer.
+ * @return seconds of the music, -1 if not heard
+ */
+double getMusicClock (void)
+{
+
+    audioclock_t            c;
+
+    if (! _readClock(&c) || c.music < 0) {
+        return -1;
+    }
+
+    return (c.music + _sinceClock(&c)) / audioRate;
+
+}
+
+
+/**
+ * Get when the time of the music is heard from the device
+ * Compare it with the time a frame is shown to schedule the frame.
+ * @param t seconds of the music
+ * @param when CLOCK_MONOTONIC time the music at t is heard
+ * @return true on success, false if the music is not heard
+ */
+bool musicDeadline (double t, struct timespec *when)
+{
+
+    audioclock_t            c;
+    double                  d;
+    long                    sec;
+
+    if (! _readClock(&c) || c.music < 0) {
+        return false;
+    }
+
+    // seconds from the snapshot, may be negative
+    d   = t - (double)c.music / audioRate;
+    sec = (long)floor(d);
+    when->tv_sec  = c.time.tv_sec + sec;
+    when->tv_nsec = c.time.tv_nsec + (long)((d - sec) * 1e9);
+    if (when->tv_nsec >= 1000000000) {
+        when->tv_sec++;
+        when->tv_nsec -= 1000000000;
+    }
+
+    return true;
+
+}
+
+
+/**
+ * Set the volume of the music
+ * @param volume volume up to AUDIO_VOLUME_MAX, AUDIO_UNITY is the original
+ */
+void setMusicVolume (int volume)
+{
+
+    __atomic_store_n(&music.volume,
+                        MAX(0, MIN(AUDIO_VOLUME_MAX, volume)), __ATOMIC_RELAXED);
 
 }
 
@@ -1159,15 +7861,15 @@ void stopMusic (void)
 
     // check if the music is being played
     pthread_mutex_lock(&playLock);
-    if (! playNow) { 
+    if (! playJoin) {
         pthread_mutex_unlock(&playLock);
         return;
     }
+    playJoin = false;
     pthread_mutex_unlock(&playLock);
 
-    // stop all the musics
-    system("killall -9 aplay  1> /dev/NULL 2> /dev/NULL");
-    system("killall -9 mpg123 1> /dev/NULL 2> /dev/NULL");
+    // the audio thread ends the voice at the next period
+    __atomic_store_n(&music.stop, true, __ATOMIC_RELEASE);
 
     //
     pthread_join(playth, NULL);
@@ -1175,6 +7877,162 @@ void stopMusic (void)
 }
 
 
+/**
+ * Last use of the sound in the cache slot, for _lruSlot()
+ * The sounds playing are kept. The sound lock must be held by the caller.
+ * @param i index of the slot
+ * @return last use, 0 if empty, ULONG_MAX if playing
+ */
+static unsigned long _soundUsed (int i)
+{
+
+    if (sounds[i].path == NULL) {
+        return 0;
+    }
+    if (__atomic_load_n(&sounds[i].active, __ATOMIC_ACQUIRE) != 0) {
+        return ULONG_MAX;
+    }
+
+    return sounds[i].used;
+
+}
+
+
+/**
+ * Load a sound effect into the cache
+ * The samples are decoded once and kept until the least recently used
+ * slot is replaced. The audio engine is started if not yet.
+ * @param path path to the WAV or MP3 file
+ * @return handle of the sound on success, SOUND_NONE on failure
+ */
+sound_t loadSound (const char * path)
+{
+
+    pcm_t                   pcm;
+    sound_t                 h = SOUND_NONE;
+    char *                  copy;
+    int                     slot = -1;
+    int                     i;
+
+    // the samples are converted to the rate of the device
+    if (! startAudio()) {
+        return SOUND_NONE;
+    }
+
+    // loaded before
+    pthread_mutex_lock(&soundLock);
+    for (i = 0; i < SOUND_CACHE_SIZE; i++) {
+        if (sounds[i].path != NULL && strcmp(sounds[i].path, path) == 0) {
+            sounds[i].used = ++soundtick;
+            h = SOUND_HANDLE(i, sounds[i].generation);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&soundLock);
+    if (h != SOUND_NONE) {
+        return h;
+    }
+
+    // decode without the lock, playSound() must not wait for the file
+    copy = strdup(path);
+    if (copy == NULL) {
+        return SOUND_NONE;
+    }
+    if (! _readPcm(path, &pcm)) {
+        fprintf(stderr, "Failed to read %s.\n", path);
+        free(copy);
+        return SOUND_NONE;
+    }
+
+    pthread_mutex_lock(&soundLock);
+
+    // empty slot, or the least recently used one not playing
+    slot = _lruSlot(SOUND_CACHE_SIZE, _soundUsed);
+    if (slot < 0) {
+        free(pcm.samples);
+        free(copy);
+        goto out;
+    }
+
+    // replace the sound in the slot
+    _releaseSound(slot);
+    sounds[slot].generation = _nextGeneration(sounds[slot].generation,
+                                                        SOUND_INDEX_BITS);
+    sounds[slot].pcm  = pcm;
+    sounds[slot].path = copy;
+    sounds[slot].used = ++soundtick;
+    h = SOUND_HANDLE(slot, sounds[slot].generation);
+
+out:
+    pthread_mutex_unlock(&soundLock);
+
+    return h;
+
+}
+
+
+/**
+ * Play a sound effect in the cache over the music
+ * @param s handle of the sound
+ * @return true on success, false on failure
+ */
+bool playSound (sound_t s)
+{
+
+    return playSoundVolume(s, AUDIO_UNITY);
+
+}
+
+
+/**
+ * Play a sound effect in the cache with the volume
+ * Only a trigger is queued to the audio thread, without file access or
+ * allocation. The effect starts at the next period on a free voice, or
+ * replaces the oldest effect if all the voices are busy.
+ * @param s handle of the sound
+ * @param volume volume up to AUDIO_VOLUME_MAX, AUDIO_UNITY is the original
+ * @return true on success, false on failure
+ */
+bool playSoundVolume (sound_t s, int volume)
+{
+
+    unsigned int            head;
+    unsigned int            tail;
+    bool                    rtn = false;
+    int                     i   = SOUND_INDEX(s);
+
+    pthread_mutex_lock(&soundLock);
+
+    // check the handle and the engine
+    if (s == SOUND_NONE || i >= SOUND_CACHE_SIZE || sounds[i].path == NULL ||
+            sounds[i].generation != SOUND_GENERATION(s) ||
+            ! __atomic_load_n(&audioRun, __ATOMIC_ACQUIRE)) {
+        goto out;
+    }
+
+    head = soundring.head;
+    tail = __atomic_load_n(&soundring.tail, __ATOMIC_ACQUIRE);
+    if (head - tail == SOUND_QUEUE) {
+        goto out;
+    }
+
+    // the slot is kept until the audio thread finishes it
+    __atomic_add_fetch(&sounds[i].active, 1, __ATOMIC_RELAXED);
+    sounds[i].used = ++soundtick;
+    soundring.triggers[head & (SOUND_QUEUE - 1)].slot   = i;
+    soundring.triggers[head & (SOUND_QUEUE - 1)].volume =
+                                    MAX(0, MIN(AUDIO_VOLUME_MAX, volume));
+    __atomic_store_n(&soundring.head, head + 1, __ATOMIC_RELEASE);
+    rtn = true;
+
+out:
+    pthread_mutex_unlock(&soundLock);
+
+    return rtn;
+
+}
+
+
 /**
  * Start server connection
  * @param port port number to listen
@@ -18,6 +18,8 @@
   ============= ====== =======================================================
   26th May 2015  0.1   Initial release
   30th Mar 2016  0.2   Add network interfaces
+  16th Oct 2026  0.3   Add offscreen mode
+  16th Oct 2026  0.4   Add audio engine
 
  *****************************************************************************/
 
@@ -27,13 +29,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -41,11 +48,15 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
 
 #include <directfb.h>
 #include <directfb_util.h>
 #include <direct/clock.h>
 
+#include <alsa/asoundlib.h>
+#include <mpg123.h>
+
 
 
 /* -------------------------- macro  declarations -------------------------- */
@@ -60,6 +71,35 @@
     } \
 }
 
+// minimum and maximum
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// number of touch events held by the input ring, power of 2
+#define INPUT_RING 256
+
+// free surfaces kept for each size class
+#define POOL_DEPTH 4
+
+// number of sound triggers held by the queue to the audio thread, power of 2
+#define SOUND_QUEUE 16
+
+// scoped timer of the frame profiler, compiled out by DFFRAME_NOPROFILE
+#ifndef DFFRAME_NOPROFILE
+#define PROF_SCOPE(name) \
+    profscope_t _profscope_##name __attribute__((cleanup(profEnd))) = \
+        profBegin(#name)
+#else
+#define PROF_SCOPE(name)
+#endif
+
+// number of phases recorded by a frame of the profiler
+#define PROF_RECORDS 512
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -91,6 +131,391 @@ typedef enum {
     ERROR
 } TouchState;
 
+// kind of touch events
+typedef enum {
+    TOUCH_PRESS,
+    TOUCH_RELEASE,
+    TOUCH_MOVE
+} TouchEventKind;
+
+// touch event read by the input thread
+typedef struct touchevent {
+    TouchEventKind          kind;
+    position_t              pos;
+    struct timeval          timestamp;
+    unsigned int            received;   // monotonic microseconds of the event
+} touchevent_t;
+
+// single-producer single-consumer ring of touch events
+typedef struct touchring {
+    touchevent_t            events[INPUT_RING];
+    unsigned int            head;       // written by the input thread
+    unsigned int            tail;       // written by the render loop
+} touchring_t;
+
+// timer of the frame profiler
+typedef struct profscope {
+    const char *            name;
+    unsigned int            start;
+    bool                    on;
+} profscope_t;
+
+// phase recorded by the frame profiler, time in microseconds
+typedef struct profrecord {
+    const char *            name;
+    unsigned int            start;
+    unsigned int            duration;
+} profrecord_t;
+
+// frame recorded by the frame profiler
+typedef struct profframe {
+    unsigned int            start;
+    unsigned int            end;
+    int                     num;
+    int                     dropped;
+    profrecord_t            records[PROF_RECORDS];
+} profframe_t;
+
+// kind of the touch position predictor
+typedef enum {
+    PREDICT_NONE,
+    PREDICT_LINEAR,
+    PREDICT_KALMAN
+} PredictKind;
+
+// state of the predictor on an axis, position, velocity and covariance
+typedef struct predictaxis {
+    double                  x;
+    double                  v;
+    double                  p00;
+    double                  p01;
+    double                  p11;
+} predictaxis_t;
+
+// touch-to-photon latency statistics in microseconds
+typedef struct latencystats {
+    unsigned long           count;
+    unsigned int            p50;
+    unsigned int            p95;
+    unsigned int            p99;
+    unsigned int            max;
+} latencystats_t;
+
+// kind of the touch position filter
+typedef enum {
+    FILTER_NONE,
+    FILTER_AVERAGE,
+    FILTER_EXPONENTIAL,
+    FILTER_ONEEURO
+} FilterKind;
+
+// touch position filter and its parameters
+typedef struct touchfilter {
+    FilterKind              kind;
+    int                     window;     // moving average, in samples
+    double                  alpha;      // exponential, 0 < alpha <= 1
+    double                  mincutoff;  // 1-euro, minimum cutoff in Hz
+    double                  beta;       // 1-euro, speed coefficient
+    double                  dcutoff;    // 1-euro, cutoff of speed in Hz
+} touchfilter_t;
+
+// handle of an image, index of the slot and generation of the image
+typedef unsigned int image_t;
+
+// status of an image
+typedef enum {
+    IMAGE_INVALID,
+    IMAGE_LOADING,
+    IMAGE_READY,
+    IMAGE_FAILED
+} ImageStatus;
+
+// job to load an image in background
+typedef struct imagejob {
+    char *                  path;
+    int                     index;
+    unsigned int            generation;
+    int                     priority;
+    unsigned long           seq;
+} imagejob_t;
+
+// header of the raw image file, followed by the pixels at offset
+typedef struct rawimage {
+    char                    magic[4];
+    uint32_t                version;
+    uint32_t                width;
+    uint32_t                height;
+    uint32_t                format;
+    uint32_t                pitch;
+    uint32_t                offset;
+} rawimage_t;
+
+// mapping of a raw image file
+typedef struct rawmap {
+    void *                  addr;
+    size_t                  size;
+    struct rawmap *         next;
+} rawmap_t;
+
+// decoded image in the cache
+typedef struct cachedimage {
+    char *                  path;
+    time_t                  mtime;
+    IDirectFBSurface *      surface;
+    DFBSurfaceDescription   desc;
+    void *                  map;
+    size_t                  mapsize;
+    size_t                  bytes;
+    int                     refs;
+    bool                    pinned;
+    bool                    stale;
+    struct cachedimage *    prev;
+    struct cachedimage *    next;
+    struct cachedimage *    hnext;
+} cachedimage_t;
+
+// slot of the image table
+typedef struct imageslot {
+    IDirectFBSurface *      surface;
+    DFBSurfaceDescription   desc;
+    cachedimage_t *         cache;
+    ImageStatus             state;
+    char *                  path;
+    unsigned int            generation;
+    int                     next;
+} imageslot_t;
+
+// handle of a sprite in the texture atlas
+typedef unsigned int sprite_t;
+
+// row of sprites in an atlas page
+typedef struct shelf {
+    int                     x;
+    int                     y;
+    int                     h;
+} shelf_t;
+
+// page of the texture atlas
+typedef struct atlaspage {
+    IDirectFBSurface *      surface;
+    shelf_t *               shelves;
+    int                     nshelves;
+    int                     maxshelves;
+    int                     top;
+} atlaspage_t;
+
+// sprite packed into an atlas page
+typedef struct spriteslot {
+    int                     page;
+    DFBRectangle            rect;
+} spriteslot_t;
+
+// points of a stroke drawn incrementally, and the pixels under its tip
+typedef struct stroke {
+    position_t *            points;
+    int                     num;
+    int                     max;
+    int                     drawn;
+    IDirectFBSurface *      under;
+    DFBRectangle            tip;
+    bool                    tipped;
+} stroke_t;
+
+// handle of a font in the registry
+typedef unsigned int font_t;
+
+// font loaded in the registry
+typedef struct fontslot {
+    IDirectFBFont *         font;
+    char *                  path;
+    int                     size;
+    unsigned int            generation;
+    unsigned long           used;
+} fontslot_t;
+
+// text laid out and rendered once, origin on the base line at -ox, -oy
+typedef struct text {
+    char *                  text;
+    font_t                  font;
+    color_t                 color;
+    IDirectFBSurface *      surface;
+    int                     ox;
+    int                     oy;
+    int                     width;
+    int                     ascender;
+    int                     descender;
+    int                     refs;
+    struct text *           prev;
+    struct text *           next;
+    struct text *           hnext;
+} text_t;
+
+// message box rendered before, drawn from the top left of the surface
+typedef struct msgbox {
+    char *                  message;
+    font_t                  font;
+    region_t                r;
+    position_t              off;
+    color_t                 fg;
+    color_t                 bg;
+    IDirectFBSurface *      surface;
+    struct msgbox *         prev;
+    struct msgbox *         next;
+    struct msgbox *         hnext;
+} msgbox_t;
+
+// free surfaces of a size class
+typedef struct surfpool {
+    IDirectFBSurface *      surfaces[POOL_DEPTH];
+    int                     num;
+} surfpool_t;
+
+// PCM samples in the format of the audio device
+typedef struct pcm {
+    int16_t *               samples;
+    long                    frames;
+} pcm_t;
+
+// decoder of a WAV or MP3 file into the format of the audio device
+typedef struct decoder {
+    int                     fd;
+    mpg123_handle *         mh;         // NULL for WAV
+    off_t                   data;       // offset of the WAV samples
+    long                    frames;     // frames of the WAV samples
+    unsigned int            rate;
+    int                     channels;
+    int                     bits;
+    uint8_t *               chunk;      // WAV samples read for a buffer
+    long                    chunkFrames;
+    long                    pos;        // next frame decoded
+} decoder_t;
+
+// buffer of the music decoded in background
+typedef struct streambuf {
+    pcm_t                   pcm;
+    long                    start;      // frame of the music at the buffer
+    unsigned int            gen;        // generation decoded, 0 if empty
+    bool                    last;       // end of the music
+} streambuf_t;
+
+// music streamed through a double buffer
+typedef struct stream {
+    streambuf_t             bufs[2];
+    sem_t                   wake;       // a buffer emptied, a seek or the end
+    long                    seek;       // frame requested, -1 for none
+    uint64_t                seeked;     // seek taken by the audio thread,
+                                        // gen << 32 | frame, 0 for none
+    unsigned int            gen;        // written by the audio thread, not 0
+    int                     cur;        // buffer played by the audio thread
+    long                    pos;        // frames played in the buffer
+} stream_t;
+
+// snapshot of the audio clock, published by the audio thread
+typedef struct audioclock {
+    unsigned int            seq;        // odd while being written
+    uint64_t                frames;     // frames heard from the device
+    uint64_t                written;    // frames written to the device
+    long                    music;      // frame of the music heard, -1 for none
+    struct timespec         time;       // monotonic time of the snapshot
+} audioclock_t;
+
+// period written to the device, to find the frame of the music heard
+typedef struct periodmark {
+    uint64_t                frame;      // frame of the device at the period
+    long                    music;      // frame of the music, -1 for none
+} periodmark_t;
+
+// voice played by the audio engine
+typedef struct voice {
+    const pcm_t *           pcm;        // samples of a sound effect
+    stream_t *              stream;     // music
+    long                    pos;
+    int                     volume;
+    int                     slot;       // sound in the cache, -1 for music
+    unsigned long           started;
+    bool                    stop;
+    bool                    done;
+} voice_t;
+
+// handle of a sound effect in the cache
+typedef unsigned int sound_t;
+
+// sound effect decoded in the cache
+typedef struct soundslot {
+    pcm_t                   pcm;
+    char *                  path;
+    unsigned int            generation;
+    unsigned long           used;
+    int                     active;     // triggers queued or playing
+} soundslot_t;
+
+// sound trigger queued to the audio thread
+typedef struct soundtrigger {
+    int                     slot;
+    int                     volume;
+} soundtrigger_t;
+
+// sound triggers queued to the audio thread
+typedef struct soundring {
+    soundtrigger_t          triggers[SOUND_QUEUE];
+    unsigned int            head;       // written by playSound()
+    unsigned int            tail;       // written by the audio thread
+} soundring_t;
+
+// kind of deferred drawing commands
+typedef enum {
+    CMD_LINE,
+    CMD_DRAWRECT,
+    CMD_FILLRECT,
+    CMD_TRIANGLE,
+    CMD_BLIT,
+    CMD_STRETCH
+} CommandKind;
+
+// deferred drawing command
+typedef struct command {
+    CommandKind             kind;
+    bool                    alpha;
+    bool                    done;
+    color_t                 color;
+    IDirectFBSurface *      source;
+    DFBRegion               bbox;
+    union {
+        DFBRegion           line;
+        DFBRectangle        rect;
+        DFBTriangle         tri;
+        struct {
+            DFBRectangle    from;
+            DFBRectangle    to;
+        } blit;
+    } g;
+} command_t;
+
+// buffer of deferred drawing commands
+typedef struct cmdbuf {
+    command_t *             cmds;
+    int                     num;
+    int                     max;
+} cmdbuf_t;
+
+// drawing context recording the commands of a thread
+typedef struct drawctx {
+    cmdbuf_t                buf;
+    color_t                 color;
+} drawctx_t;
+
+// commands submitted by a context, drawn at the next flip
+typedef struct ctxbatch {
+    cmdbuf_t                buf;
+    struct ctxbatch *       next;
+} ctxbatch_t;
+
+// statistics of the state changes
+typedef struct statestats {
+    unsigned long           issued;
+    unsigned long           skipped;
+} statestats_t;
+
 typedef struct server {
     struct sockaddr_in      addr;
     struct sockaddr_in      sender;
@@ -111,20 +536,174 @@ typedef struct connection udpsocket_t;
 
 /* ------------------------------- parameters ------------------------------ */
 
-// position was examined every POSSAMPLES(60) samples by means of average
+// maximum window of the moving average of positions in samples
 #define POSSAMPLES 60 
 
+// default parameters of the touch position filter
+#define FILTER_WINDOW    8
+#define FILTER_ALPHA     0.5
+#define FILTER_MINCUTOFF 1.0
+#define FILTER_BETA      0.007
+#define FILTER_DCUTOFF   1.0
+
+// sampling period assumed if the time of samples is unknown, in seconds
+#define FILTER_PERIOD    0.005
+
+// interval to retry queueing a touch on/off event in microseconds
+#define INPUT_RETRY      1000
+
+// default time to extrapolate touch positions in seconds
+#define PREDICT_LEAD     0.020
+
+// maximum distance of the extrapolation in pixels
+#define PREDICT_MAXDIST  40
+
+// smoothing factor of the velocity of the linear predictor
+#define PREDICT_ALPHA    0.5
+
+// variances of the Kalman predictor, acceleration and measurement
+#define PREDICT_NOISE    1.0e6
+#define PREDICT_ERROR    4.0
+
+// buckets of the latency histogram, LATENCY_SUB per power of 2
+#define LATENCY_SUBBITS  3
+#define LATENCY_SUB      (1 << LATENCY_SUBBITS)
+#define LATENCY_BUCKETS  ((32 - LATENCY_SUBBITS) * LATENCY_SUB)
+
+// longest time an input event is counted as queued, in microseconds
+#define INPUT_AGE_MAX    1000000
+
+// number of frames kept by the frame profiler
+#define PROF_FRAMES      120
+
 // calibration
 static const int            CalX1       =   205;
 static const int            CalY1       =  3587;
 static const int            CalXR       =  3738;
 static const int            CalYR       = -3371;
 
+// primary surface in offscreen mode
+#define OFFSCREEN_WIDTH  800
+#define OFFSCREEN_HEIGHT 480
+#define OFFSCREEN_FORMAT DSPF_RGB16
+#define OFFSCREEN_SYSTEM "dummy"
+
+// maximum number of damaged regions tracked until flip
+#define MAX_DAMAGE 16
+
+// whole screen is flipped if damaged regions cover this percentage
+#define DAMAGE_FULLRATIO 50
+
+// initial number of commands in the deferred command buffer
+#define CMDBUF_INITIAL 256
+
+// maximum number of primitives submitted by a batch call
+#define BATCH_SIZE 256
+
+// handles of the slots, index in the low bits and generation above,
+// the generation is never 0 so that no handle is 0
+#define HANDLE_NONE                0
+#define HANDLE_MAKE(i, g, bits)    (((unsigned int)(g) << (bits)) | (i))
+#define HANDLE_INDEX(h, bits)      ((int)((h) & ((1u << (bits)) - 1)))
+#define HANDLE_GENERATION(h, bits) ((h) >> (bits))
+
+// image handles
+#define IMAGE_NONE            HANDLE_NONE
+#define IMAGE_INDEX_BITS      16
+#define IMAGE_HANDLE(i, g)    HANDLE_MAKE(i, g, IMAGE_INDEX_BITS)
+#define IMAGE_INDEX(h)        HANDLE_INDEX(h, IMAGE_INDEX_BITS)
+#define IMAGE_GENERATION(h)   HANDLE_GENERATION(h, IMAGE_INDEX_BITS)
+
+// maximum number of image slots
+#define MAX_IMAGES (1 << IMAGE_INDEX_BITS)
+
+// number of chains of the image path hash, power of 2
+#define IMAGE_HASH 256
+
+// memory budget of the decoded image cache in bytes
+#define IMAGE_CACHE_BUDGET (8 * 1024 * 1024)
+
+// raw image file
+#define RAWIMAGE_MAGIC   "DFRI"
+#define RAWIMAGE_VERSION 1
+#define RAWIMAGE_ALIGN   4096
+
+// texture atlas, sprites are separated by the padding
+#define SPRITE_NONE   0
+#define ATLAS_WIDTH   1024
+#define ATLAS_HEIGHT  1024
+#define ATLAS_PADDING 1
+
+// number of fonts kept loaded in the registry
+#define FONT_CACHE_SIZE 8
+
+// font handles
+#define FONT_NONE             HANDLE_NONE
+#define FONT_INDEX_BITS       8
+#define FONT_HANDLE(i, g)     HANDLE_MAKE(i, g, FONT_INDEX_BITS)
+#define FONT_INDEX(h)         HANDLE_INDEX(h, FONT_INDEX_BITS)
+#define FONT_GENERATION(h)    HANDLE_GENERATION(h, FONT_INDEX_BITS)
+
+// maximum number of rendered texts kept, and chains of their hash
+#define TEXT_CACHE_SIZE 128
+#define TEXT_HASH       64
+
+// size classes of pooled surfaces, POOL_MIN << class in each direction
+#define POOL_MIN     16
+#define POOL_CLASSES 8
+
+// video memory of the cached message boxes and pooled surfaces in bytes
+#define POOL_BUDGET  (4 * 1024 * 1024)
+
+// maximum number of message boxes kept, and chains of their hash
+#define BOX_CACHE_SIZE 32
+#define BOX_HASH       32
+
+// number of threads to load images in background
+#define LOADER_THREADS 2
+
+// initial number of points in a stroke
+#define STROKE_INITIAL 256
+
 // maximum lenght of file path string
-// used for making command string to play musics
+// used for keeping the path of the music played
 #define MAXPATHSTR 255
 #define STRBUFFLEN 512
 
+// audio device, its rate and channels of signed 16 bit samples
+#define AUDIO_DEVICE   "hw:0,1"
+#define AUDIO_RATE     44100
+#define AUDIO_CHANNELS 2
+
+// frames of a period and periods in the buffer of the audio device
+#define AUDIO_PERIOD   256
+#define AUDIO_PERIODS  3
+
+// periods remembered to find the music heard, more than in the buffer
+#define AUDIO_HISTORY  8
+
+// real-time priority of the audio thread
+#define AUDIO_PRIORITY 50
+
+// voices mixed including the music, and the volumes of unity and maximum
+#define AUDIO_VOICES      8
+#define AUDIO_VOLUME_BITS 8
+#define AUDIO_UNITY       (1 << AUDIO_VOLUME_BITS)
+#define AUDIO_VOLUME_MAX  (AUDIO_UNITY * 4)
+
+// frames of each buffer of the music stream
+#define STREAM_FRAMES 8192
+
+// number of sound effects kept decoded in the cache
+#define SOUND_CACHE_SIZE 16
+
+// sound handles
+#define SOUND_NONE            HANDLE_NONE
+#define SOUND_INDEX_BITS      8
+#define SOUND_HANDLE(i, g)    HANDLE_MAKE(i, g, SOUND_INDEX_BITS)
+#define SOUND_INDEX(h)        HANDLE_INDEX(h, SOUND_INDEX_BITS)
+#define SOUND_GENERATION(h)   HANDLE_GENERATION(h, SOUND_INDEX_BITS)
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -138,12 +717,27 @@ static const int            CalYR       = -3371;
 /* ------------------------ prototype  declarations ------------------------ */
 
 void init                    (int *argc, char ***argv);
+void initOffscreen           (int *argc, char ***argv,
+                              int w, int h, DFBSurfacePixelFormat format);
+void setOffscreen            (int w, int h, DFBSurfacePixelFormat format);
+bool isOffscreen             (void);
 void initialize              (int *argc, char ***argv);
 void createPrimarySurface    (void);
 void createEventBuffer       (void);
 void initSemaphore           (void);
 
 void flip                    (void);
+void setPartialFlip          (bool enable);
+void setBackBufferSync       (bool enable);
+void setDeferred             (bool enable);
+void submitCommands          (void);
+drawctx_t * createContext    (void);
+void bindContext             (drawctx_t *ctx);
+bool submitContext           (drawctx_t *ctx);
+void releaseContext          (drawctx_t *ctx);
+statestats_t getStateStats   (void);
+void resetStateStats         (void);
+void addDamage               (region_t r);
 void clearScreen             (void);
 void setColor                (int r, int g, int b, int a);
 void fillScreen              (int r, int g, int b, int a);
@@ -154,33 +748,102 @@ void releaseImage            (int index);
 bool getInputEvent           (DFBInputEvent *e);
 bool handleButton            (DFBInputEvent *e);
 bool handleAxes              (DFBInputEvent *e);
+void setTouchFilter          (touchfilter_t f);
+touchfilter_t getTouchFilter (void);
+void setPredictor            (PredictKind kind, double lead);
+position_t predictPosition   (void);
+bool startInputThread        (void);
+void stopInputThread         (void);
+bool pollInput               (touchevent_t *e);
+bool waitInput               (touchevent_t *e);
+latencystats_t getLatency    (void);
+void resetLatency            (void);
+void setLatencyDump          (int seconds);
+
+bool setProfiling            (bool enable);
+bool dumpProfile             (const char *path);
+profscope_t profBegin        (const char *name);
+void profEnd                 (profscope_t *s);
 position_t eventLoop         (void);
 TouchState getTouchState     (void);
 
 bool readImage               (int index, const char * path);
+image_t loadImage            (const char * path);
+image_t findImage            (const char * path);
+int  imageIndex              (image_t image);
+image_t readImageAsync       (int index, const char * path, int priority);
+image_t loadImageAsync       (const char * path, int priority);
+ImageStatus imageStatus      (image_t image);
+bool waitImage               (image_t image);
+bool convertRawImage         (const char * src, const char * dst,
+                              DFBSurfacePixelFormat format);
+bool pinImage                (const char * path, bool pin);
+void setImageCacheBudget     (size_t bytes);
+size_t getImageCacheSize     (void);
 
 void renderImage             (int index, bool alpha);
 void putImage                (int index, position_t p, bool alpha);
 void stretchImage            (int index, region_t from, region_t to, bool alpha);
 
+sprite_t addSprite           (const char * path);
+int  addSprites              (const char ** paths, int num, sprite_t * handles);
+void releaseSprites          (void);
+scsize_t getSpriteSize       (sprite_t s);
+void putSprite               (sprite_t s, position_t p, bool alpha);
+void putSprites              (const sprite_t * s, const position_t * p, int num,
+                              bool alpha);
+void stretchSprite           (sprite_t s, region_t to, bool alpha);
+
 void rectangle               (region_t r, bool fill);
 void line                    (position_t from, position_t to);
+void polyline                (const position_t *points, int num);
 void triangle                (position_t p1, position_t p2, position_t p3);
 
+stroke_t * createStroke      (void);
+bool appendStroke            (stroke_t *s, position_t p);
+void drawStroke              (stroke_t *s);
+void drawStrokeTip           (stroke_t *s);
+void clearStroke             (stroke_t *s);
+void releaseStroke           (stroke_t *s);
+
 scsize_t getSize             (void);
 scsize_t getSurfaceSize      (int index);
 
+font_t loadFont              (const char * path, int size);
+bool useFont                 (font_t f);
 bool setFont                 (const char * path, int size);
 int  stringWidth             (const char * text);
+int  stringWidthFont         (font_t f, const char * text);
 void putString               (const char * text, position_t p);
 void putStringAligned        (const char * text, position_t p, DFBSurfaceTextFlags flg);
+void putStringFont           (font_t f, const char * text, position_t p,
+                              DFBSurfaceTextFlags flg);
+text_t * createText          (const char * text);
+text_t * createTextFont      (font_t f, const char * text);
+void releaseText             (text_t * t);
+scsize_t textSize            (const text_t * t);
+void putText                 (const text_t * t, position_t p,
+                              DFBSurfaceTextFlags flg);
+void putStringCached         (const char * text, position_t p,
+                              DFBSurfaceTextFlags flg);
 void unsetFont               (void);
 
 void messageBox              (const char * message, region_t r, position_t off, color_t fg, color_t bg);
 
+bool startAudio              (void);
+void stopAudio               (void);
 void playMusic               (const char * path, bool back);
 int  isPlaying               (void);
+long getMusicPosition        (void);
+bool seekMusic               (long frame);
+double getAudioClock         (void);
+double getMusicClock         (void);
+bool musicDeadline           (double t, struct timespec *when);
+void setMusicVolume          (int volume);
 void stopMusic               (void);
+sound_t loadSound            (const char * path);
+bool playSound               (sound_t s);
+bool playSoundVolume         (sound_t s, int volume);
 
 // TCP server and connection
 server_t     * startServer   (int port, int backlog);
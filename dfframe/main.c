@@ -32,42 +32,58 @@ int main (int argc, char **argv)
     // DirectFB の初期化
     init(&argc, &argv);
 
+    // 裏面を表面と同期させる
+    setBackBufferSync(true);
+
     // 画像の読み込み
     readImage(0, "pict.png");
-    reanderImage(0, false);
+    renderImage(0, false);
     flip();
 
-    // 裏面にも読み込み
-    reanderImage(0, false);
-    
     // ペンの色設定
     setColor(0, 0, 0, 0xff);
 
+    // ストロークの作成
+    stroke_t * s = createStroke();
+    touchevent_t e;
+
+    // 入力スレッドの開始
+    startInputThread();
+
+    // 指先の位置を予測してペン先を描く
+    setPredictor(PREDICT_KALMAN, 0);
+
     while(1) {
         // タッチ入力待ち
-        position_t p1, p2;
-        p1 = eventLoop();
+        if (! waitInput(&e) || e.kind != TOUCH_PRESS) {
+            continue;
+        }
+        clearStroke(s);
 
         while (getTouchState() == TOUCHED) {
-            // 座標取得
-            p2 = eventLoop();
+            // 溜まった座標を全て取得
+            {
+                PROF_SCOPE(input);
+                while (pollInput(&e) && e.kind == TOUCH_MOVE) {
+                    appendStroke(s, e.pos);
+                }
+            }
 
             // 線描画
-            line(p1, p2);
+            drawStrokeTip(s);
 
             // 画面切替
             flip();
-
-            // 裏面にも線描画
-            line(p1, p2);
-
-            // 座標保存
-            p1 = p2;
         }
 
+        // ペン先を消す
+        drawStroke(s);
+        flip();
+
     }
 
     // リソース解放
+    releaseStroke(s);
     release();
 
     return 0;